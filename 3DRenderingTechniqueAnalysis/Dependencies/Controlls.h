@@ -1,6 +1,7 @@
 #pragma once
 
-void Engine::Controlls(float fElapsedTime)
+// Returns true if the player moved or turned this frame
+bool Engine::Controlls(float fElapsedTime)
 {
 	float movementSpeed = 8 * fElapsedTime;
 	float rotationSpeed = 2.5 * fElapsedTime;
@@ -20,6 +21,9 @@ void Engine::Controlls(float fElapsedTime)
 	q_rotation = &q_worldRotation;
 #endif
 
+	Vec3D v_previousPosition = *v_movement;
+	Quaternion q_previousRotation = *q_rotation;
+
 	// Movement
 
 	if (GetKey(olc::Key::W).bHeld)
@@ -134,6 +138,22 @@ void Engine::Controlls(float fElapsedTime)
 		*q_rotation = QuaternionMultiplication(*q_rotation, rotationQuaternion);
 	}
 
+#ifdef RAY_TRACER
+	// Options
+
+	if (GetKey(olc::Key::TAB).bPressed)
+	{
+		Options::showSampleCounts = !Options::showSampleCounts;
+	}
+
+	if (GetKey(olc::Key::N).bPressed)
+	{
+		Options::sampler = SamplerType((Options::sampler + 1) % SAMPLER_TYPE_COUNT);
+
+		std::cout << "Sampler: " << SamplerName(Options::sampler) << std::endl;
+	}
+#endif
+
 #ifdef RASTERIZER
 	// Offset every triangle in opposite direction of player's movement
 	for (int i = 0; i < g_triangles.size(); i++)
@@ -144,4 +164,10 @@ void Engine::Controlls(float fElapsedTime)
 		}
 	}
 #endif
+
+	bool moved = v_movement->x != v_previousPosition.x || v_movement->y != v_previousPosition.y || v_movement->z != v_previousPosition.z;
+	bool rotated = q_rotation->realPart != q_previousRotation.realPart || q_rotation->vecPart.x != q_previousRotation.vecPart.x
+		|| q_rotation->vecPart.y != q_previousRotation.vecPart.y || q_rotation->vecPart.z != q_previousRotation.vecPart.z;
+
+	return moved || rotated;
 }
\ No newline at end of file
@@ -54,6 +54,7 @@ void ParseMTL(std::string objPath, std::string mtlName, std::vector<Triangle>* s
 	{
 		std::string meshPartName;
 		Vec3D tint;
+		Vec3D emittance = ZERO_VEC3D;
 		olc::Sprite* texture;
 
 		while (getline(file, line)) // Jumps to new line every loop
@@ -66,6 +67,10 @@ void ParseMTL(std::string objPath, std::string mtlName, std::vector<Triangle>* s
 				{
 					tint = { stof(values[1]), stof(values[2]), stof(values[3]) };
 				}
+				if (values[0] == "Ke") // Emittance, makes the triangles light sources
+				{
+					emittance = { stof(values[1]), stof(values[2]), stof(values[3]) };
+				}
 				if (values[0] == "map_Kd") // Texture
 				{
 					texture = new olc::Sprite(assetsPath + values[1]);
@@ -101,6 +106,11 @@ void ParseMTL(std::string objPath, std::string mtlName, std::vector<Triangle>* s
 				scene->at(i).texture = texture;
 				scene->at(i).material = meshPart.material;
 				scene->at(i).normalMap = meshPart.normalMap;
+
+				if (VecLength3D(emittance) > 0)
+				{
+					scene->at(i).material.emittance = emittance;
+				}
 			}
 		}
 
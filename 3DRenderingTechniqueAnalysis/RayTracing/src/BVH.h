@@ -0,0 +1,403 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "MathUtilities.cuh"
+#include "WorldDatatypes.h"
+#include "Scene.h"
+
+// Bounding volume hierarchy over all spheres and triangles in the scene, built with the surface area heuristic (SAH)
+
+#define BVH_BIN_COUNT 16 // number of centroid bins evaluated per axis when looking for the cheapest split
+#define BVH_MAX_LEAF_SIZE 4 // leaves with more primitives than this are always split if possible
+#define BVH_MAX_DEPTH 60 // nodes this deep become leaves, keeps the traversal stack bounded
+#define BVH_STACK_SIZE 64
+#define BVH_TRAVERSAL_COST 1.0 // relative cost of visiting a node compared to intersecting a primitive
+
+struct AABB
+{
+	Vec3D min = { INFINITY, INFINITY, INFINITY };
+	Vec3D max = { -INFINITY, -INFINITY, -INFINITY };
+};
+
+struct PrimitiveReference
+{
+	PrimitiveType type;
+	int index; // index into g_spheres or g_triangles
+};
+
+struct BVHNode
+{
+	AABB bounds;
+	int firstIndex; // leaves: first primitive in BVH::primitives, interior nodes: left child (the right child is the node after it)
+	int primitiveCount; // 0 for interior nodes
+};
+
+struct BVH
+{
+	std::vector<BVHNode> nodes;
+	std::vector<PrimitiveReference> primitives;
+};
+
+//
+// Methods for bounding boxes
+//
+
+inline double AxisComponent(Vec3D v, int axis)
+{
+	return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+}
+
+void GrowAABB(AABB* box, Vec3D point)
+{
+	box->min = { Min(box->min.x, point.x), Min(box->min.y, point.y), Min(box->min.z, point.z) };
+	box->max = { Max(box->max.x, point.x), Max(box->max.y, point.y), Max(box->max.z, point.z) };
+}
+
+void GrowAABB(AABB* box, AABB other)
+{
+	box->min = { Min(box->min.x, other.min.x), Min(box->min.y, other.min.y), Min(box->min.z, other.min.z) };
+	box->max = { Max(box->max.x, other.max.x), Max(box->max.y, other.max.y), Max(box->max.z, other.max.z) };
+}
+
+double SurfaceAreaAABB(AABB box)
+{
+	Vec3D extent = SubtractVec3D(box.max, box.min);
+
+	if (extent.x < 0) return 0; // empty box
+
+	return 2 * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+Vec3D CentroidAABB(AABB box)
+{
+	return Lerp3D(box.min, box.max, 0.5);
+}
+
+AABB SphereAABB(const Sphere& sphere)
+{
+	Vec3D v_radius = { sphere.radius, sphere.radius, sphere.radius };
+
+	return { SubtractVec3D(sphere.coords, v_radius), AddVec3D(sphere.coords, v_radius) };
+}
+
+AABB TriangleAABB(const Triangle& triangle)
+{
+	AABB box;
+
+	for (int i = 0; i < 3; i++)
+	{
+		GrowAABB(&box, triangle.vertices[i]);
+	}
+
+	return box;
+}
+
+// Slab test, tEntry is measured in multiples of the (unnormalized) ray direction
+inline bool RayAABBIntersection(const AABB& box, Vec3D v_start, Vec3D v_inverseDirection, double tMax, double* tEntry)
+{
+	double tx1 = (box.min.x - v_start.x) * v_inverseDirection.x;
+	double tx2 = (box.max.x - v_start.x) * v_inverseDirection.x;
+	double ty1 = (box.min.y - v_start.y) * v_inverseDirection.y;
+	double ty2 = (box.max.y - v_start.y) * v_inverseDirection.y;
+	double tz1 = (box.min.z - v_start.z) * v_inverseDirection.z;
+	double tz2 = (box.max.z - v_start.z) * v_inverseDirection.z;
+
+	double tNear = Max(Max(Min(tx1, tx2), Min(ty1, ty2)), Min(tz1, tz2));
+	double tFar = Min(Min(Max(tx1, tx2), Max(ty1, ty2)), Max(tz1, tz2));
+
+	*tEntry = tNear;
+
+	return tFar >= Max(tNear, 0.0) && tNear <= tMax;
+}
+
+//
+// Building
+//
+
+struct BVHBuildData
+{
+	std::vector<PrimitiveReference> references;
+	std::vector<AABB> bounds;
+	std::vector<Vec3D> centroids;
+	std::vector<int> order; // primitive indices, partitioned in place while building
+};
+
+void SubdivideBVHNode(BVH* bvh, BVHBuildData* data, int nodeIndex, int depth)
+{
+	int first = bvh->nodes[nodeIndex].firstIndex;
+	int count = bvh->nodes[nodeIndex].primitiveCount;
+
+	if (count <= 1 || depth >= BVH_MAX_DEPTH)
+	{
+		return;
+	}
+
+	AABB centroidBounds;
+
+	for (int i = first; i < first + count; i++)
+	{
+		GrowAABB(&centroidBounds, data->centroids[data->order[i]]);
+	}
+
+	// Binned SAH: sort the centroids into bins along each axis and evaluate the split planes between the bins
+	double bestCost = INFINITY;
+	int bestAxis = -1;
+	int bestSplit = 0;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		double axisMin = AxisComponent(centroidBounds.min, axis);
+		double axisExtent = AxisComponent(centroidBounds.max, axis) - axisMin;
+
+		if (axisExtent <= 0)
+		{
+			continue; // all centroids lie in the same plane
+		}
+
+		AABB binBounds[BVH_BIN_COUNT];
+		int binCounts[BVH_BIN_COUNT] = { 0 };
+
+		double binScalar = BVH_BIN_COUNT / axisExtent;
+
+		for (int i = first; i < first + count; i++)
+		{
+			int primitive = data->order[i];
+			int bin = Min(BVH_BIN_COUNT - 1, int((AxisComponent(data->centroids[primitive], axis) - axisMin) * binScalar));
+
+			GrowAABB(&binBounds[bin], data->bounds[primitive]);
+			binCounts[bin]++;
+		}
+
+		// Sweep from the right to get the area and primitive count on the right side of every split
+		double rightAreas[BVH_BIN_COUNT];
+		int rightCounts[BVH_BIN_COUNT];
+
+		AABB rightBox;
+		int rightCount = 0;
+
+		for (int i = BVH_BIN_COUNT - 1; i > 0; i--)
+		{
+			GrowAABB(&rightBox, binBounds[i]);
+			rightCount += binCounts[i];
+
+			rightAreas[i] = SurfaceAreaAABB(rightBox);
+			rightCounts[i] = rightCount;
+		}
+
+		AABB leftBox;
+		int leftCount = 0;
+
+		for (int i = 0; i < BVH_BIN_COUNT - 1; i++)
+		{
+			GrowAABB(&leftBox, binBounds[i]);
+			leftCount += binCounts[i];
+
+			if (leftCount == 0 || rightCounts[i + 1] == 0)
+			{
+				continue;
+			}
+
+			double cost = leftCount * SurfaceAreaAABB(leftBox) + rightCounts[i + 1] * rightAreas[i + 1];
+
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = i;
+			}
+		}
+	}
+
+	if (bestAxis == -1)
+	{
+		return; // every centroid is in the same spot, there is nothing to split
+	}
+
+	double nodeArea = SurfaceAreaAABB(bvh->nodes[nodeIndex].bounds);
+
+	// Cost of the split relative to intersecting every primitive in this node
+	double splitCost = BVH_TRAVERSAL_COST + bestCost / nodeArea;
+
+	if (splitCost >= count && count <= BVH_MAX_LEAF_SIZE)
+	{
+		return; // cheaper as a leaf
+	}
+
+	double axisMin = AxisComponent(centroidBounds.min, bestAxis);
+	double binScalar = BVH_BIN_COUNT / (AxisComponent(centroidBounds.max, bestAxis) - axisMin);
+
+	int* middle = std::partition(&data->order[first], &data->order[first] + count, [&](int primitive)
+	{
+		int bin = Min(BVH_BIN_COUNT - 1, int((AxisComponent(data->centroids[primitive], bestAxis) - axisMin) * binScalar));
+
+		return bin <= bestSplit;
+	});
+
+	int leftCount = int(middle - &data->order[first]);
+
+	if (leftCount == 0 || leftCount == count)
+	{
+		return;
+	}
+
+	int leftChild = int(bvh->nodes.size());
+
+	BVHNode left = { AABB(), first, leftCount };
+	BVHNode right = { AABB(), first + leftCount, count - leftCount };
+
+	for (int i = left.firstIndex; i < left.firstIndex + left.primitiveCount; i++) GrowAABB(&left.bounds, data->bounds[data->order[i]]);
+	for (int i = right.firstIndex; i < right.firstIndex + right.primitiveCount; i++) GrowAABB(&right.bounds, data->bounds[data->order[i]]);
+
+	bvh->nodes.push_back(left);
+	bvh->nodes.push_back(right);
+
+	bvh->nodes[nodeIndex].firstIndex = leftChild;
+	bvh->nodes[nodeIndex].primitiveCount = 0;
+
+	SubdivideBVHNode(bvh, data, leftChild, depth + 1);
+	SubdivideBVHNode(bvh, data, leftChild + 1, depth + 1);
+}
+
+void BuildBVH(BVH* bvh, const std::vector<Sphere>& spheres, const std::vector<Triangle>& triangles)
+{
+	BVHBuildData data;
+
+	int primitiveCount = int(spheres.size() + triangles.size());
+
+	data.references.reserve(primitiveCount);
+	data.bounds.reserve(primitiveCount);
+
+	for (int i = 0; i < spheres.size(); i++)
+	{
+		data.references.push_back({ SPHERE_PRIMITIVE, i });
+		data.bounds.push_back(SphereAABB(spheres[i]));
+	}
+
+	for (int i = 0; i < triangles.size(); i++)
+	{
+		data.references.push_back({ TRIANGLE_PRIMITIVE, i });
+		data.bounds.push_back(TriangleAABB(triangles[i]));
+	}
+
+	data.centroids.resize(primitiveCount);
+	data.order.resize(primitiveCount);
+
+	AABB rootBounds;
+
+	for (int i = 0; i < primitiveCount; i++)
+	{
+		data.centroids[i] = CentroidAABB(data.bounds[i]);
+		data.order[i] = i;
+
+		GrowAABB(&rootBounds, data.bounds[i]);
+	}
+
+	bvh->nodes.clear();
+	bvh->primitives.clear();
+
+	if (primitiveCount == 0)
+	{
+		return;
+	}
+
+	bvh->nodes.reserve(2 * primitiveCount);
+	bvh->nodes.push_back({ rootBounds, 0, primitiveCount });
+
+	SubdivideBVHNode(bvh, &data, 0, 0);
+
+	// Store the primitives in leaf order so every leaf is a contiguous range
+	bvh->primitives.resize(primitiveCount);
+
+	for (int i = 0; i < primitiveCount; i++)
+	{
+		bvh->primitives[i] = data.references[data.order[i]];
+	}
+}
+
+//
+// Traversal
+//
+
+// Visits the primitives in every leaf the ray passes through, nearest nodes first.
+// intersectPrimitive(PrimitiveReference) returns true to stop the traversal, and may lower *tMax to skip nodes that start further away.
+template<typename IntersectFunction>
+void TraverseBVH(const BVH& bvh, Vec3D v_start, Vec3D v_direction, double* tMax, IntersectFunction intersectPrimitive)
+{
+	if (bvh.nodes.empty())
+	{
+		return;
+	}
+
+	Vec3D v_inverseDirection = { 1 / v_direction.x, 1 / v_direction.y, 1 / v_direction.z };
+
+	struct StackEntry
+	{
+		int node;
+		double tEntry;
+	};
+
+	StackEntry stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+
+	double tRoot;
+
+	if (!RayAABBIntersection(bvh.nodes[0].bounds, v_start, v_inverseDirection, *tMax, &tRoot))
+	{
+		return;
+	}
+
+	stack[stackSize++] = { 0, tRoot };
+
+	while (stackSize > 0)
+	{
+		StackEntry entry = stack[--stackSize];
+
+		if (entry.tEntry > *tMax)
+		{
+			continue; // something closer was found after this node was pushed
+		}
+
+		const BVHNode& node = bvh.nodes[entry.node];
+
+		if (node.primitiveCount > 0)
+		{
+			for (int i = node.firstIndex; i < node.firstIndex + node.primitiveCount; i++)
+			{
+				if (intersectPrimitive(bvh.primitives[i]))
+				{
+					return;
+				}
+			}
+
+			continue;
+		}
+
+		int nearChild = node.firstIndex;
+		int farChild = node.firstIndex + 1;
+
+		double tNear, tFar;
+
+		bool hitNear = RayAABBIntersection(bvh.nodes[nearChild].bounds, v_start, v_inverseDirection, *tMax, &tNear);
+		bool hitFar = RayAABBIntersection(bvh.nodes[farChild].bounds, v_start, v_inverseDirection, *tMax, &tFar);
+
+		if (hitNear && hitFar && tFar < tNear)
+		{
+			std::swap(nearChild, farChild);
+			std::swap(tNear, tFar);
+		}
+		else if (!hitNear)
+		{
+			// Only the far child (if any) is left, move it into the near slot
+			nearChild = farChild;
+			tNear = tFar;
+			hitNear = hitFar;
+			hitFar = false;
+		}
+
+		// Push the far child first so the near child is visited first
+		if (hitFar) stack[stackSize++] = { farChild, tFar };
+		if (hitNear) stack[stackSize++] = { nearChild, tNear };
+	}
+}
@@ -0,0 +1,396 @@
+#pragma once
+
+// Benchmarks that can be enabled with the *_BENCHMARK settings at the top of RayTracing.cu
+// They run once in OnUserCreate and print their results to the console
+
+#define BENCHMARK_RAY_COUNT 200000
+
+// Runs a benchmark on a scene of its own: g_spheres and g_triangles start out empty, the benchmark fills them and calls PrepareScene.
+// The real scene is swapped back and prepared again afterwards
+void Engine::WithBenchmarkScene(const std::function<void()>& benchmark)
+{
+	std::vector<Sphere> savedSpheres;
+	std::vector<Triangle> savedTriangles;
+
+	std::swap(savedSpheres, g_spheres);
+	std::swap(savedTriangles, g_triangles);
+
+	benchmark();
+
+	std::swap(savedSpheres, g_spheres);
+	std::swap(savedTriangles, g_triangles);
+
+	PrepareScene();
+}
+
+// Traces random rays through random triangle soups of growing size.
+// With the BVH the rays/sec should fall roughly logarithmically with the triangle count, not linearly.
+void Engine::BenchmarkBVH()
+{
+	Sampler benchmarkSampler(RandomGenerator(1337)); // fixed seed so runs are comparable
+
+	const double sceneSize = 3.0;
+
+	std::cout << "BVH benchmark (" << BENCHMARK_RAY_COUNT << " rays per scene)" << std::endl;
+
+	WithBenchmarkScene([&]()
+	{
+		for (int triangleCount = 10; triangleCount <= 1000000; triangleCount *= 10)
+		{
+			// Triangles shrink as the count grows so the scene stays about equally dense
+			double triangleSize = sceneSize / cbrt(double(triangleCount));
+
+			g_triangles.clear();
+			g_triangles.reserve(triangleCount);
+
+			for (int i = 0; i < triangleCount; i++)
+			{
+				Vec3D v_center = { benchmarkSampler.NextDouble() * sceneSize, benchmarkSampler.NextDouble() * sceneSize + 0.1, benchmarkSampler.NextDouble() * sceneSize };
+
+				Triangle triangle;
+				triangle.material = { ZERO_VEC3D, { 1, 1, 1 }, 0.5, 0.5, 1.5, ZERO_VEC3D, 0, DIELECTRIC };
+
+				for (int j = 0; j < 3; j++)
+				{
+					triangle.vertices[j] = AddVec3D(v_center, VecScalarMultiplication3D(RandomVec_InUnitSphere(&benchmarkSampler), triangleSize));
+				}
+
+				g_triangles.push_back(triangle);
+			}
+
+			auto buildStart = std::chrono::steady_clock::now();
+
+			PrepareScene();
+
+			std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - buildStart;
+
+			// Generate the rays up front so only the tracing is timed
+			std::vector<Vec3D> rayStarts(BENCHMARK_RAY_COUNT);
+			std::vector<Vec3D> rayDirections(BENCHMARK_RAY_COUNT);
+
+			for (int i = 0; i < BENCHMARK_RAY_COUNT; i++)
+			{
+				rayStarts[i] = { benchmarkSampler.NextDouble() * sceneSize, benchmarkSampler.NextDouble() * sceneSize + 0.1, benchmarkSampler.NextDouble() * sceneSize };
+				rayDirections[i] = ReturnNormalizedVec3D(RandomVec_InUnitSphere(&benchmarkSampler));
+			}
+
+			int hitCount = 0;
+
+			auto traceStart = std::chrono::steady_clock::now();
+
+			for (int i = 0; i < BENCHMARK_RAY_COUNT; i++)
+			{
+				Vec3D v_intersection = ZERO_VEC3D;
+				Vec3D v_color = ZERO_VEC3D;
+				Quaternion q_normal = IDENTITY_QUATERNION;
+				Material material;
+
+				hitCount += NextIntersection(rayStarts[i], rayDirections[i], &v_intersection, &v_color, &q_normal, &material);
+			}
+
+			std::chrono::duration<double> traceTime = std::chrono::steady_clock::now() - traceStart;
+
+			std::cout << "  " << triangleCount << " triangles: "
+				<< "build " << buildTime.count() * 1000.0 << "ms, "
+				<< BENCHMARK_RAY_COUNT / traceTime.count() << " rays/sec, "
+				<< g_bvh.nodes.size() << " nodes, "
+				<< hitCount << " hits" << std::endl;
+		}
+	});
+}
+
+// Times the reference TriangleIntersection_RT against the baked triangle intersection on the same ray/triangle pairs
+void Engine::BenchmarkTriangleIntersection()
+{
+	Sampler benchmarkSampler(RandomGenerator(1337));
+
+	const int triangleCount = 1000;
+	const int raysPerTriangle = 1000;
+
+	// A scene of its own so the baked kernel can read the benchmark triangles through g_sceneGeometry
+	WithBenchmarkScene([&]()
+	{
+		g_triangles.resize(triangleCount);
+
+		for (Triangle& triangle : g_triangles)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				triangle.vertices[j] = RandomVec_InUnitSphere(&benchmarkSampler);
+			}
+		}
+
+		PrepareScene();
+
+		// Rays start outside the unit sphere and aim roughly at the center, so about half of them hit
+		std::vector<Vec3D> rayStarts(raysPerTriangle);
+		std::vector<Vec3D> rayDirections(raysPerTriangle);
+
+		for (int i = 0; i < raysPerTriangle; i++)
+		{
+			rayStarts[i] = VecScalarMultiplication3D(ReturnNormalizedVec3D(RandomVec_InUnitSphere(&benchmarkSampler)), 3);
+			rayDirections[i] = ReturnNormalizedVec3D(SubtractVec3D(VecScalarMultiplication3D(RandomVec_InUnitSphere(&benchmarkSampler), 0.5), rayStarts[i]));
+		}
+
+		auto TimeKernel = [&](const char* name, auto kernel)
+		{
+			int hitCount = 0;
+
+			auto start = std::chrono::steady_clock::now();
+
+			for (int i = 0; i < triangleCount; i++)
+			{
+				for (int j = 0; j < raysPerTriangle; j++)
+				{
+					hitCount += kernel(i, rayStarts[j], rayDirections[j]);
+				}
+			}
+
+			std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+			std::cout << "  " << name << ": " << time.count() * 1e9 / (double(triangleCount) * raysPerTriangle) << "ns per test, " << hitCount << " hits" << std::endl;
+		};
+
+		std::cout << "Triangle intersection benchmark (" << triangleCount * raysPerTriangle << " tests)" << std::endl;
+
+		TimeKernel("reference (point, color, normal)", [&](int i, Vec3D v_start, Vec3D v_direction)
+		{
+			Vec3D v_intersection, v_color;
+			Quaternion q_normal;
+
+			return TriangleIntersection_RT(g_triangles[i], v_start, v_direction, &v_intersection, &v_color, &q_normal);
+		});
+
+		TimeKernel("baked (point, color, normal)", [&](int i, Vec3D v_start, Vec3D v_direction)
+		{
+			Vec3D v_intersection, v_color;
+			Quaternion q_normal;
+
+			double t, u, v;
+
+			if (!IntersectTriangle(g_sceneGeometry, i, v_start, v_direction, &t, &u, &v))
+			{
+				return false;
+			}
+
+			v_intersection = AddVec3D(v_start, VecScalarMultiplication3D(v_direction, t));
+			TriangleSurfaceInteraction(i, v_direction, u, v, &v_color, &q_normal);
+
+			return true;
+		});
+
+		TimeKernel("baked (distance only)", [&](int i, Vec3D v_start, Vec3D v_direction)
+		{
+			double t;
+
+			return TriangleDistance_RT(i, v_start, v_direction, &t);
+		});
+	});
+}
+
+// Times RandomGenerator against the std::mt19937 + std::uniform_real_distribution it replaced,
+// then renders a frame on this thread and estimates how much of it went into generating random numbers
+void Engine::BenchmarkRandom()
+{
+	const int drawCount = 10000000;
+
+	double sum = 0; // printed so the compiler can't remove the loops
+
+	std::cout << "Random number benchmark (" << drawCount << " draws)" << std::endl;
+
+	std::mt19937 mersenneTwister(1337);
+	std::uniform_real_distribution<> uniformDistribution(0, 1);
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < drawCount; i++)
+	{
+		sum += uniformDistribution(mersenneTwister);
+	}
+
+	std::chrono::duration<double> mersenneTwisterTime = std::chrono::steady_clock::now() - start;
+
+	RandomGenerator randomGenerator(1337);
+
+	start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < drawCount; i++)
+	{
+		sum += randomGenerator.NextDouble();
+	}
+
+	std::chrono::duration<double> randomGeneratorTime = std::chrono::steady_clock::now() - start;
+
+	double nsPerDraw = randomGeneratorTime.count() * 1e9 / drawCount;
+
+	std::cout << "  std::mt19937: " << mersenneTwisterTime.count() * 1e9 / drawCount << "ns per draw" << std::endl;
+	std::cout << "  RandomGenerator: " << nsPerDraw << "ns per draw (sum " << sum << ")" << std::endl;
+
+#if RANDOM_BENCHMARK == 1
+	// The draws are only counted when RANDOM_BENCHMARK is enabled
+	PlanAdaptiveSampling();
+	g_tileScheduler.Reset(1);
+	g_frameDeadline = std::chrono::steady_clock::time_point::max(); // the whole frame, even with a FRAME_TIME_BUDGET
+	g_randomDrawCount = 0;
+
+	start = std::chrono::steady_clock::now();
+
+	RenderTiles(0);
+
+	std::chrono::duration<double> frameTime = std::chrono::steady_clock::now() - start;
+
+	std::cout << "  one frame: " << frameTime.count() * 1000.0 << "ms, " << g_randomDrawCount << " draws, about "
+		<< 100 * g_randomDrawCount * nsPerDraw * 1e-9 / frameTime.count() << "% of the frame spent generating random numbers" << std::endl;
+#endif
+}
+
+// The accumulated image with its colors clamped to the displayable range, so the benchmarks compare what ends up on the screen.
+// Also gives the average number of samples per pixel if samplesPerPixel isn't null
+std::vector<Vec3D> AccumulatedImage(double* samplesPerPixel)
+{
+	std::vector<Vec3D> image(SCREEN_WIDTH * SCREEN_HEIGHT);
+	long long sampleCount = 0;
+
+	for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+	{
+		const AccumulatedColor& accumulatedColor = g_accumulationBuffer[i];
+
+		Vec3D color = { accumulatedColor.r, accumulatedColor.g, accumulatedColor.b };
+		ScaleVec3D(&color, 1 / double(Max(accumulatedColor.sampleCount, 1)));
+
+		image[i] = { Min(color.x, 1.0), Min(color.y, 1.0), Min(color.z, 1.0) };
+		sampleCount += accumulatedColor.sampleCount;
+	}
+
+	if (samplesPerPixel != nullptr)
+	{
+		*samplesPerPixel = sampleCount / double(SCREEN_WIDTH * SCREEN_HEIGHT);
+	}
+
+	return image;
+}
+
+double ImageRMSE(const std::vector<Vec3D>& image, const std::vector<Vec3D>& reference)
+{
+	double squaredErrorSum = 0;
+
+	for (int i = 0; i < image.size(); i++)
+	{
+		Vec3D error = SubtractVec3D(image[i], reference[i]);
+		squaredErrorSum += DotProduct3D(error, error);
+	}
+
+	return sqrt(squaredErrorSum / (image.size() * 3));
+}
+
+// Renders a reference image with next event estimation, then gives the path tracer with and without it the same time
+// and prints the RMSE of both against the reference. Colors are clamped to the displayable range first
+void Engine::BenchmarkNextEventEstimation()
+{
+	const double equalTime = 2.0; // seconds
+	const double referenceTime = 30 * equalTime; // long enough that the noise of the reference doesn't hide the difference
+
+	auto RenderFor = [&](double seconds)
+	{
+		ResetAccumulation();
+
+		auto start = std::chrono::steady_clock::now();
+
+		while (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < seconds)
+		{
+			StartThreads();
+			g_frameIndex++;
+		}
+
+		double samplesPerPixel;
+		std::vector<Vec3D> image = AccumulatedImage(&samplesPerPixel);
+
+		std::cout << "  " << samplesPerPixel << " samples per pixel";
+
+		return image;
+	};
+
+	bool savedNextEventEstimation = Options::nextEventEstimation;
+
+	std::cout << "Next event estimation benchmark (" << equalTime << "s per integrator)" << std::endl;
+
+	Options::nextEventEstimation = true;
+	std::vector<Vec3D> reference = RenderFor(referenceTime);
+	std::cout << " in the reference" << std::endl;
+
+	Options::nextEventEstimation = false;
+	std::vector<Vec3D> bsdfSampling = RenderFor(equalTime);
+	std::cout << " without next event estimation, RMSE " << ImageRMSE(bsdfSampling, reference) << std::endl;
+
+	Options::nextEventEstimation = true;
+	std::vector<Vec3D> nextEventEstimation = RenderFor(equalTime);
+	std::cout << " with next event estimation, RMSE " << ImageRMSE(nextEventEstimation, reference) << std::endl;
+
+	Options::nextEventEstimation = savedNextEventEstimation;
+
+	ResetAccumulation();
+}
+
+// Renders every sampler with the same number of samples per pixel and prints the RMSE against a reference rendered with many more independent samples.
+// Colors are clamped to the displayable range first
+void Engine::BenchmarkSamplers()
+{
+	const int referenceSamplesPerPixel = 1024;
+	const int samplesPerPixel[] = { 4, 16, 64 };
+
+#if ASYNC == 1
+	int threadCount = int(g_renderThreads.threads.size());
+#else
+	int threadCount = 1;
+#endif
+
+	auto Render = [&](SamplerType sampler, int sampleCount)
+	{
+		ResetAccumulation();
+
+		g_renderSampler = sampler;
+		std::fill(std::begin(g_frameSampleCounts), std::end(g_frameSampleCounts), sampleCount); // all samples in one pass
+		g_tileScheduler.Reset(threadCount);
+		g_frameDeadline = std::chrono::steady_clock::time_point::max();
+
+#if ASYNC == 1
+		g_renderThreads.RunFrame();
+#else
+		RenderTiles(0);
+#endif
+
+		return AccumulatedImage(nullptr);
+	};
+
+	SamplerType savedSampler = g_renderSampler;
+	int savedFrameIndex = g_frameIndex;
+
+	std::cout << "Sampler benchmark (reference with " << referenceSamplesPerPixel << " independent samples per pixel)" << std::endl;
+
+	// A frame index of its own so the reference noise is independent of the independent sampler's below
+	g_frameIndex = savedFrameIndex + 1;
+	std::vector<Vec3D> reference = Render(INDEPENDENT_SAMPLER, referenceSamplesPerPixel);
+	g_frameIndex = savedFrameIndex;
+
+	for (int type = 0; type < SAMPLER_TYPE_COUNT; type++)
+	{
+		std::cout << "  " << SamplerName(SamplerType(type)) << ":";
+
+		for (int sampleCount : samplesPerPixel)
+		{
+			auto start = std::chrono::steady_clock::now();
+
+			std::vector<Vec3D> image = Render(SamplerType(type), sampleCount);
+
+			std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+			std::cout << " " << sampleCount << " spp RMSE " << ImageRMSE(image, reference) << " (" << time.count() * 1000.0 << "ms)";
+		}
+
+		std::cout << std::endl;
+	}
+
+	g_renderSampler = savedSampler;
+
+	ResetAccumulation();
+}
@@ -0,0 +1,457 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <emmintrin.h>
+
+#include "MathUtilities.cuh"
+#include "PostProcessing.h"
+
+// Edge avoiding a-trous wavelet filter (Dammertz et al., "Edge-Avoiding A-Trous Wavelet Transform for fast Global Illumination Filtering")
+// with the variance guided luminance weight of SVGF (Schied et al., "Spatiotemporal Variance-Guided Filtering").
+// It filters illumination, the accumulated color divided by the albedo of the first hit, so textures are multiplied back in sharp afterwards.
+// Every iteration is a 3x3 B spline kernel with its taps twice as far apart as in the one before, and every tap is weighted down
+// by how much its first hit normal, depth and luminance differ from the pixel's. The luminance weight is scaled by the standard deviation
+// of the pixel's mean, so converged pixels are left alone.
+// Every step works on rows, so the threads can split them, and on four pixels at once with SSE2
+
+#define DENOISER_ITERATIONS 5 // taps up to 2^(DENOISER_ITERATIONS - 1) pixels apart
+#define DENOISER_NORMAL_POWER_LOG2 3 // the normal weight is dot(n, n')^(2^this). SVGF uses 128, which rejects most taps on normal mapped surfaces
+#define DENOISER_DEPTH_SIGMA 1.0f // depth difference that weighs a tap down by 1/e, in depth gradients per pixel of distance
+#define DENOISER_LUMINANCE_SIGMA 4.0f // luminance difference that weighs a tap down by 1/e, in standard deviations
+#define DENOISER_MARGIN (1 << (DENOISER_ITERATIONS - 1)) // empty columns on both sides of every row, the widest taps read into them instead of past the row
+#define DENOISER_NORMAL_BITS 10 // per axis of the packed normals, 3 of them fit into 32 bits
+
+// Features of the first surface a camera ray hits, the denoiser doesn't filter across edges in them
+struct SurfaceFeatures
+{
+	Vec3D albedo;
+	Vec3D normal;
+	double depth; // distance from the camera, 0 if the ray left the scene
+};
+
+// Planes of one value per pixel, the pixel x, y is at y * stride + DENOISER_MARGIN + x (see DenoiserIndex).
+// The margins and the padding at the end of the rows have a zero normal, which no tap is weighted with
+struct DenoiserBuffers
+{
+	int width = 0;
+	int height = 0;
+	int stride = 0;
+
+	// Iterations read from one index and write to the other, the input is at 0
+	std::vector<float> illumination[2][3];
+	std::vector<float> luminance[2];
+	std::vector<float> variance[2]; // of the luminance of the mean, negative for pixels with too few samples to estimate it, see PrepareDenoiserRows
+
+	std::vector<float> albedo[3]; // divided out of the colors before the iterations and multiplied back in after them, never 0
+	std::vector<uint32_t> normal; // from PackDenoiserNormal, one load per tap instead of three
+	std::vector<float> depth;
+	std::vector<float> depthScale; // 1 / (DENOISER_DEPTH_SIGMA * depth gradient), from PrepareDenoiserRows
+	std::vector<float> luminanceScale; // -1 / (DENOISER_LUMINANCE_SIGMA * standard deviation) for the current iteration, from DenoiserLuminanceScaleRows
+};
+
+const uint32_t DENOISER_NORMAL_MASK = (1u << DENOISER_NORMAL_BITS) - 1;
+const float DENOISER_NORMAL_SCALE = float((1 << (DENOISER_NORMAL_BITS - 1)) - 1); // stored for an axis of 1
+
+// Every axis rounded to a signed DENOISER_NORMAL_BITS integer, x in the lowest bits
+uint32_t PackDenoiserNormal(Vec3D v_normal)
+{
+	const double axes[3] = { v_normal.x, v_normal.y, v_normal.z };
+
+	uint32_t packed = 0;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		int value = int(lround(Clamp(axes[axis], -1.0, 1.0) * DENOISER_NORMAL_SCALE));
+
+		packed |= (uint32_t(value) & DENOISER_NORMAL_MASK) << (axis * DENOISER_NORMAL_BITS);
+	}
+
+	return packed;
+}
+
+// Unpacks one axis of four packed normals, multiplied by scale. The axis is shifted to the top bits and back, which extends its sign
+__m128 UnpackDenoiserNormalAxis(__m128i packed, int axis, __m128 scale)
+{
+	__m128i value = _mm_srai_epi32(_mm_slli_epi32(packed, 32 - DENOISER_NORMAL_BITS * (axis + 1)), 32 - DENOISER_NORMAL_BITS);
+
+	return _mm_mul_ps(_mm_cvtepi32_ps(value), scale);
+}
+
+void ResizeDenoiserBuffers(DenoiserBuffers* buffers, int width, int height)
+{
+	buffers->width = width;
+	buffers->height = height;
+	buffers->stride = DENOISER_MARGIN + (width + 3) / 4 * 4 + DENOISER_MARGIN;
+
+	size_t size = size_t(buffers->stride) * height;
+
+	for (int i = 0; i < 2; i++)
+	{
+		for (int channel = 0; channel < 3; channel++)
+		{
+			buffers->illumination[i][channel].assign(size, 0);
+		}
+
+		buffers->luminance[i].assign(size, 0);
+		buffers->variance[i].assign(size, 0);
+	}
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		buffers->albedo[axis].assign(size, 1);
+	}
+
+	buffers->normal.assign(size, PackDenoiserNormal(ZERO_VEC3D));
+	buffers->depth.assign(size, 0);
+	buffers->depthScale.assign(size, 0);
+	buffers->luminanceScale.assign(size, 0);
+}
+
+int DenoiserIndex(const DenoiserBuffers& buffers, int x, int y)
+{
+	return y * buffers.stride + DENOISER_MARGIN + x;
+}
+
+// The input is set in two steps, so the features can be taken from the accumulation while the colors are still being filtered.
+// Pass a negative variance if the pixel has too few samples to estimate it, PrepareDenoiserRows estimates it from the neighbours then
+void SetDenoiserFeatures(DenoiserBuffers* buffers, int x, int y, double variance, Vec3D albedo, Vec3D v_normal, double depth)
+{
+	int index = DenoiserIndex(*buffers, x, y);
+
+	buffers->variance[0][index] = float(variance);
+
+	buffers->albedo[0][index] = float(albedo.x);
+	buffers->albedo[1][index] = float(albedo.y);
+	buffers->albedo[2][index] = float(albedo.z);
+
+	buffers->normal[index] = PackDenoiserNormal(v_normal);
+	buffers->depth[index] = float(depth);
+}
+
+// Second step of the input: the illumination is the color divided by the albedo
+void DemodulateRows(DenoiserBuffers* buffers, const ColorPlanes& colors, int startRow, int endRow)
+{
+	const std::vector<float>* colorChannels[3] = { &colors.r, &colors.g, &colors.b };
+	const __m128 luminanceWeights[3] = { _mm_set1_ps(0.2126f), _mm_set1_ps(0.7152f), _mm_set1_ps(0.0722f) };
+
+	for (int y = startRow; y < endRow; y++)
+	{
+		int colorRow = ColorPlanesIndex(colors, 0, y);
+		int row = DenoiserIndex(*buffers, 0, y);
+
+		for (int x = 0; x < buffers->width; x += 4)
+		{
+			__m128 luminance = _mm_setzero_ps();
+
+			for (int channel = 0; channel < 3; channel++)
+			{
+				__m128 illumination = _mm_div_ps(_mm_loadu_ps(colorChannels[channel]->data() + colorRow + x), _mm_loadu_ps(buffers->albedo[channel].data() + row + x));
+
+				_mm_storeu_ps(buffers->illumination[0][channel].data() + row + x, illumination);
+
+				luminance = _mm_add_ps(luminance, _mm_mul_ps(luminanceWeights[channel], illumination));
+			}
+
+			_mm_storeu_ps(buffers->luminance[0].data() + row + x, luminance);
+		}
+	}
+}
+
+// Filtered illumination after the last iteration times the albedo, the rows of the colors are extended for the filters after it
+void RemodulateRows(const DenoiserBuffers& buffers, ColorPlanes* colors, int startRow, int endRow)
+{
+	std::vector<float>* colorChannels[3] = { &colors->r, &colors->g, &colors->b };
+	const __m128 luminanceWeights[3] = { _mm_set1_ps(0.2126f), _mm_set1_ps(0.7152f), _mm_set1_ps(0.0722f) };
+
+	const auto& illumination = buffers.illumination[DENOISER_ITERATIONS % 2];
+
+	for (int y = startRow; y < endRow; y++)
+	{
+		int colorRow = ColorPlanesIndex(*colors, 0, y);
+		int row = DenoiserIndex(buffers, 0, y);
+
+		for (int x = 0; x < buffers.width; x += 4)
+		{
+			__m128 luminance = _mm_setzero_ps();
+
+			for (int channel = 0; channel < 3; channel++)
+			{
+				__m128 color = _mm_mul_ps(_mm_loadu_ps(illumination[channel].data() + row + x), _mm_loadu_ps(buffers.albedo[channel].data() + row + x));
+
+				_mm_storeu_ps(colorChannels[channel]->data() + colorRow + x, color);
+
+				luminance = _mm_add_ps(luminance, _mm_mul_ps(luminanceWeights[channel], color));
+			}
+
+			_mm_storeu_ps(colors->luminance.data() + colorRow + x, _mm_max_ps(luminance, _mm_setzero_ps()));
+		}
+	}
+
+	ExtendColorPlanesRows(colors, startRow, endRow);
+}
+
+// Runs after every row has its input. Fills in the missing variances with the spatial variance of the luminance around the pixel,
+// and the depth scale from the smaller depth difference to the neighbours on either side, so silhouettes don't count as slopes
+void PrepareDenoiserRows(DenoiserBuffers* buffers, int startRow, int endRow)
+{
+	const int width = buffers->width;
+	const int height = buffers->height;
+
+	for (int y = startRow; y < endRow; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			int index = DenoiserIndex(*buffers, x, y);
+			float depth = buffers->depth[index];
+
+			if (buffers->variance[0][index] < 0)
+			{
+				float sum = 0;
+				float squaredSum = 0;
+				int count = 0;
+
+				for (int neighbourY = std::max(y - 1, 0); neighbourY <= std::min(y + 1, height - 1); neighbourY++)
+				{
+					for (int neighbourX = std::max(x - 1, 0); neighbourX <= std::min(x + 1, width - 1); neighbourX++)
+					{
+						float luminance = buffers->luminance[0][DenoiserIndex(*buffers, neighbourX, neighbourY)];
+
+						sum += luminance;
+						squaredSum += luminance * luminance;
+						count++;
+					}
+				}
+
+				float mean = sum / count;
+
+				buffers->variance[0][index] = std::max(squaredSum / count - mean * mean, 0.0f) * count / (count - 1);
+			}
+
+			float gradient = 0;
+
+			if (depth > 0)
+			{
+				for (int axis = 0; axis < 2; axis++)
+				{
+					float axisGradient = INFINITY;
+
+					for (int side = -1; side <= 1; side += 2)
+					{
+						int neighbourX = (axis == 0) ? x + side : x;
+						int neighbourY = (axis == 1) ? y + side : y;
+
+						if (neighbourX < 0 || neighbourX >= width || neighbourY < 0 || neighbourY >= height) continue;
+
+						float neighbourDepth = buffers->depth[DenoiserIndex(*buffers, neighbourX, neighbourY)];
+
+						if (neighbourDepth > 0) axisGradient = std::min(axisGradient, std::abs(neighbourDepth - depth));
+					}
+
+					if (axisGradient < INFINITY) gradient = std::max(gradient, axisGradient);
+				}
+			}
+
+			// The depth term keeps surfaces facing the camera, whose gradient is about 0, from rejecting every tap over rounding errors
+			buffers->depthScale[index] = 1 / (DENOISER_DEPTH_SIGMA * gradient + 1e-3f * depth + 1e-6f);
+		}
+	}
+}
+
+// Scale of the luminance weight of an iteration, from a 3x3 blur of the variance: single estimates are too noisy to scale it with.
+// The blur is split into a vertical pass into a row of column sums and a horizontal pass over them, every row of the iteration before has to be finished
+void DenoiserLuminanceScaleRows(DenoiserBuffers* buffers, int iteration, int startRow, int endRow)
+{
+	const float* variance = buffers->variance[iteration % 2].data();
+
+	const __m128 center = _mm_set1_ps(0.5f);
+	const __m128 side = _mm_set1_ps(0.25f);
+	const __m128 zero = _mm_setzero_ps();
+
+	// Column sums of the row and the rows next to it, from 4 columns before the row into the margin after it
+	std::vector<float> columnSums(buffers->stride);
+	float* columns = columnSums.data() + DENOISER_MARGIN;
+
+	for (int y = startRow; y < endRow; y++)
+	{
+		const float* above = variance + DenoiserIndex(*buffers, 0, std::max(y - 1, 0));
+		const float* row = variance + DenoiserIndex(*buffers, 0, y);
+		const float* below = variance + DenoiserIndex(*buffers, 0, std::min(y + 1, buffers->height - 1));
+
+		for (int x = -4; x < buffers->width + 4; x += 4)
+		{
+			__m128 sum = _mm_add_ps(_mm_mul_ps(center, _mm_loadu_ps(row + x)), _mm_mul_ps(side, _mm_add_ps(_mm_loadu_ps(above + x), _mm_loadu_ps(below + x))));
+
+			_mm_storeu_ps(columns + x, sum);
+		}
+
+		float* luminanceScale = buffers->luminanceScale.data() + DenoiserIndex(*buffers, 0, y);
+
+		for (int x = 0; x < buffers->width; x += 4)
+		{
+			__m128 blurredVariance = _mm_add_ps(_mm_mul_ps(center, _mm_loadu_ps(columns + x)), _mm_mul_ps(side, _mm_add_ps(_mm_loadu_ps(columns + x - 1), _mm_loadu_ps(columns + x + 1))));
+
+			_mm_storeu_ps(luminanceScale + x, _mm_div_ps(_mm_set1_ps(-1.0f),
+				_mm_add_ps(_mm_mul_ps(_mm_set1_ps(DENOISER_LUMINANCE_SIGMA), _mm_sqrt_ps(_mm_max_ps(blurredVariance, zero))), _mm_set1_ps(1e-6f))));
+		}
+	}
+}
+
+// e^x of four lanes for x <= 0 as 2^(x / ln 2), with the fraction from its Taylor series. Relative error below 2e-4, underflows to about 0 below -80
+__m128 FastExp(__m128 x)
+{
+	__m128 exponent = _mm_mul_ps(_mm_max_ps(x, _mm_set1_ps(-80.0f)), _mm_set1_ps(1.44269504f));
+
+	// Truncation rounds towards 0, so the fraction is in (-1, 0]
+	__m128i integerPart = _mm_cvttps_epi32(exponent);
+	__m128 fraction = _mm_sub_ps(exponent, _mm_cvtepi32_ps(integerPart));
+
+	__m128 power = _mm_set1_ps(1.33335581e-3f);
+	power = _mm_add_ps(_mm_mul_ps(power, fraction), _mm_set1_ps(9.61812911e-3f));
+	power = _mm_add_ps(_mm_mul_ps(power, fraction), _mm_set1_ps(5.55041087e-2f));
+	power = _mm_add_ps(_mm_mul_ps(power, fraction), _mm_set1_ps(2.40226507e-1f));
+	power = _mm_add_ps(_mm_mul_ps(power, fraction), _mm_set1_ps(6.93147181e-1f));
+	power = _mm_add_ps(_mm_mul_ps(power, fraction), _mm_set1_ps(1.0f));
+
+	// 2^integerPart built straight into the exponent bits
+	__m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(integerPart, _mm_set1_epi32(127)), 23));
+
+	return _mm_mul_ps(power, scale);
+}
+
+// One iteration on the rows, every row of the iteration before and of its DenoiserLuminanceScaleRows has to be finished
+void DenoiserIterationRows(DenoiserBuffers* buffers, int iteration, int startRow, int endRow)
+{
+	const int source = iteration % 2;
+	const int destination = 1 - source;
+	const int step = 1 << iteration;
+	const bool lastIteration = (iteration == DENOISER_ITERATIONS - 1); // nothing reads its variance
+
+	const float kernel[2] = { 0.5f, 0.25f }; // B spline weights by the distance in taps, the 3x3 kernel is their outer product
+	const float inverseDistances[2] = { 1.0f / step, 1.0f / (step * 1.41421356f) }; // for straight and diagonal taps
+
+	const float* illuminationR = buffers->illumination[source][0].data();
+	const float* illuminationG = buffers->illumination[source][1].data();
+	const float* illuminationB = buffers->illumination[source][2].data();
+	const float* luminance = buffers->luminance[source].data();
+	const float* variance = buffers->variance[source].data();
+	const uint32_t* normal = buffers->normal.data();
+	const float* depth = buffers->depth.data();
+	const float* depthScale = buffers->depthScale.data();
+	const float* luminanceScales = buffers->luminanceScale.data();
+
+	float* filteredR = buffers->illumination[destination][0].data();
+	float* filteredG = buffers->illumination[destination][1].data();
+	float* filteredB = buffers->illumination[destination][2].data();
+	float* filteredLuminance = buffers->luminance[destination].data();
+	float* filteredVariance = buffers->variance[destination].data();
+
+	// Weights of taps across edges get tiny enough to be denormal, which is many times slower to multiply with. Flushed to 0 until the rows are done
+	unsigned int controlStatus = _mm_getcsr();
+	_mm_setcsr(controlStatus | 0x8040);
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	const __m128 normalScale = _mm_set1_ps(1.0f / (DENOISER_NORMAL_SCALE * DENOISER_NORMAL_SCALE)); // of the center normal, so the dot product comes out unscaled
+
+	for (int y = startRow; y < endRow; y++)
+	{
+		for (int x = 0; x < buffers->width; x += 4)
+		{
+			int index = DenoiserIndex(*buffers, x, y);
+
+			__m128 luminanceScale = _mm_loadu_ps(luminanceScales + index);
+
+			__m128i centerNormal = _mm_loadu_si128((const __m128i*)(normal + index));
+			__m128 centerNormalX = UnpackDenoiserNormalAxis(centerNormal, 0, normalScale);
+			__m128 centerNormalY = UnpackDenoiserNormalAxis(centerNormal, 1, normalScale);
+			__m128 centerNormalZ = UnpackDenoiserNormalAxis(centerNormal, 2, normalScale);
+			__m128 centerDepth = _mm_loadu_ps(depth + index);
+			__m128 centerDepthScale = _mm_loadu_ps(depthScale + index);
+
+			// Negative, so the weight is e^(the sum of the scaled differences)
+			__m128 tapDepthScales[2] =
+			{
+				_mm_mul_ps(centerDepthScale, _mm_set1_ps(-inverseDistances[0])),
+				_mm_mul_ps(centerDepthScale, _mm_set1_ps(-inverseDistances[1]))
+			};
+			__m128 centerLuminance = _mm_loadu_ps(luminance + index);
+
+			// The pixel itself always counts, so pixels without any similar neighbour keep their color
+			__m128 centerWeight = _mm_set1_ps(kernel[0] * kernel[0]);
+
+			__m128 sumR = _mm_mul_ps(centerWeight, _mm_loadu_ps(illuminationR + index));
+			__m128 sumG = _mm_mul_ps(centerWeight, _mm_loadu_ps(illuminationG + index));
+			__m128 sumB = _mm_mul_ps(centerWeight, _mm_loadu_ps(illuminationB + index));
+			__m128 weightSum = centerWeight;
+			__m128 varianceSum = _mm_mul_ps(_mm_mul_ps(centerWeight, centerWeight), _mm_loadu_ps(variance + index));
+
+			for (int offsetY = -1; offsetY <= 1; offsetY++)
+			{
+				int tapY = y + offsetY * step;
+
+				if (tapY < 0 || tapY >= buffers->height) continue;
+
+				for (int offsetX = -1; offsetX <= 1; offsetX++)
+				{
+					if (offsetX == 0 && offsetY == 0) continue;
+
+					// The margins are wide enough for the horizontal taps
+					int tap = DenoiserIndex(*buffers, x + offsetX * step, tapY);
+
+					__m128i tapNormal = _mm_loadu_si128((const __m128i*)(normal + tap));
+
+					__m128 normalWeight = _mm_add_ps(_mm_add_ps(
+						UnpackDenoiserNormalAxis(tapNormal, 0, centerNormalX),
+						UnpackDenoiserNormalAxis(tapNormal, 1, centerNormalY)),
+						UnpackDenoiserNormalAxis(tapNormal, 2, centerNormalZ));
+					normalWeight = _mm_max_ps(normalWeight, zero);
+
+					for (int i = 0; i < DENOISER_NORMAL_POWER_LOG2; i++)
+					{
+						normalWeight = _mm_mul_ps(normalWeight, normalWeight);
+					}
+
+					__m128 depthDifference = _mm_and_ps(_mm_sub_ps(centerDepth, _mm_loadu_ps(depth + tap)), absMask);
+					__m128 luminanceDifference = _mm_and_ps(_mm_sub_ps(centerLuminance, _mm_loadu_ps(luminance + tap)), absMask);
+
+					__m128 exponent = _mm_add_ps(
+						_mm_mul_ps(depthDifference, tapDepthScales[std::abs(offsetX) + std::abs(offsetY) - 1]),
+						_mm_mul_ps(luminanceDifference, luminanceScale));
+
+					__m128 weight = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(kernel[std::abs(offsetX)] * kernel[std::abs(offsetY)]), normalWeight), FastExp(exponent));
+
+					sumR = _mm_add_ps(sumR, _mm_mul_ps(weight, _mm_loadu_ps(illuminationR + tap)));
+					sumG = _mm_add_ps(sumG, _mm_mul_ps(weight, _mm_loadu_ps(illuminationG + tap)));
+					sumB = _mm_add_ps(sumB, _mm_mul_ps(weight, _mm_loadu_ps(illuminationB + tap)));
+					weightSum = _mm_add_ps(weightSum, weight);
+					if (!lastIteration)
+					{
+						varianceSum = _mm_add_ps(varianceSum, _mm_mul_ps(_mm_mul_ps(weight, weight), _mm_loadu_ps(variance + tap)));
+					}
+				}
+			}
+
+			__m128 inverseWeightSum = _mm_div_ps(_mm_set1_ps(1.0f), weightSum);
+
+			__m128 r = _mm_mul_ps(sumR, inverseWeightSum);
+			__m128 g = _mm_mul_ps(sumG, inverseWeightSum);
+			__m128 b = _mm_mul_ps(sumB, inverseWeightSum);
+
+			_mm_storeu_ps(filteredR + index, r);
+			_mm_storeu_ps(filteredG + index, g);
+			_mm_storeu_ps(filteredB + index, b);
+			_mm_storeu_ps(filteredLuminance + index, _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(_mm_set1_ps(0.2126f), r), _mm_mul_ps(_mm_set1_ps(0.7152f), g)), _mm_mul_ps(_mm_set1_ps(0.0722f), b)));
+
+			// The variance of a weighted mean, for the luminance weight of the next iteration
+			if (!lastIteration)
+			{
+				_mm_storeu_ps(filteredVariance + index, _mm_mul_ps(varianceSum, _mm_mul_ps(inverseWeightSum, inverseWeightSum)));
+			}
+		}
+	}
+
+	_mm_setcsr(controlStatus);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// Hands finished frames from the render loop to the post processing thread. The frames are a fixed set of buffers known by their index:
+// the render loop takes a free one, traces into it and submits it, the post processing thread takes the submitted ones in order and frees them.
+// There are no more frames than buffers, so when post processing falls behind the render loop waits for a free buffer instead of running ahead
+
+struct FrameQueue
+{
+	std::vector<int> freeFrames;
+	std::deque<int> submittedFrames;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+
+	bool stopping = false;
+
+	void Reset(int frameCount)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		freeFrames.clear();
+		submittedFrames.clear();
+
+		for (int i = 0; i < frameCount; i++)
+		{
+			freeFrames.push_back(i);
+		}
+	}
+
+	// Wakes everything that waits, from then on no frames are handed out
+	void Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+
+		changed.notify_all();
+	}
+
+	// Waits for a free frame, -1 once the queue is stopped
+	int AcquireFree()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		changed.wait(lock, [this]() { return stopping || !freeFrames.empty(); });
+
+		if (stopping) return -1;
+
+		int frame = freeFrames.back();
+		freeFrames.pop_back();
+
+		return frame;
+	}
+
+	// Waits for the oldest submitted frame, -1 once the queue is stopped
+	int AcquireSubmitted()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		changed.wait(lock, [this]() { return stopping || !submittedFrames.empty(); });
+
+		if (stopping) return -1;
+
+		int frame = submittedFrames.front();
+		submittedFrames.pop_front();
+
+		return frame;
+	}
+
+	void Submit(int frame)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			submittedFrames.push_back(frame);
+		}
+
+		changed.notify_all();
+	}
+
+	// Gives back a frame taken with either of the Acquire functions
+	void Free(int frame)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			freeFrames.push_back(frame);
+		}
+
+		changed.notify_all();
+	}
+};
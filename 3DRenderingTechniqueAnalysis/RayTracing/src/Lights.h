@@ -0,0 +1,120 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "MathUtilities.cuh"
+#include "WorldDatatypes.h"
+#include "BVH.h"
+#include "Sampler.h"
+
+// Table of every sphere and triangle that emits light, built together with the BVH whenever the scene changes.
+// Lights are picked in proportion to their emitted power with a binary search over the cumulative distribution,
+// so lighting a shading point costs the same no matter how many primitives or lights the scene has
+
+struct LightTable
+{
+	std::vector<PrimitiveReference> emitters;
+	std::vector<double> cdf; // probability of picking one of emitters[0] to emitters[i], the last entry is 1
+	std::vector<double> probabilities; // probability of picking emitters[i]
+
+	// Index into emitters for every sphere and triangle, -1 if it doesn't emit light
+	std::vector<int> sphereLightIndices;
+	std::vector<int> triangleLightIndices;
+};
+
+// Emitted power up to a constant factor: luminance of the radiance times the area. Textures are ignored, the tint stands in for them
+double EmitterPower(const Material& material, double area)
+{
+	Vec3D radiance = ConusProduct(material.emittance, material.diffuseTint);
+
+	return (0.2126 * radiance.x + 0.7152 * radiance.y + 0.0722 * radiance.z) * area;
+}
+
+void BuildLightTable(LightTable* lights, const std::vector<Sphere>& spheres, const std::vector<Triangle>& triangles)
+{
+	lights->emitters.clear();
+	lights->cdf.clear();
+	lights->probabilities.clear();
+	lights->sphereLightIndices.assign(spheres.size(), -1);
+	lights->triangleLightIndices.assign(triangles.size(), -1);
+
+	std::vector<double> powers;
+
+	for (int i = 0; i < spheres.size(); i++)
+	{
+		double power = EmitterPower(spheres[i].material, 2 * TAU * spheres[i].radius * spheres[i].radius);
+
+		if (power <= 0) continue;
+
+		lights->sphereLightIndices[i] = int(lights->emitters.size());
+		lights->emitters.push_back({ SPHERE_PRIMITIVE, i });
+		powers.push_back(power);
+	}
+
+	for (int i = 0; i < triangles.size(); i++)
+	{
+		const Triangle& triangle = triangles[i];
+
+		double area = 0.5 * VecLength3D(CrossProduct(SubtractVec3D(triangle.vertices[1], triangle.vertices[0]), SubtractVec3D(triangle.vertices[2], triangle.vertices[0])));
+		double power = EmitterPower(triangle.material, area);
+
+		if (power <= 0) continue;
+
+		lights->triangleLightIndices[i] = int(lights->emitters.size());
+		lights->emitters.push_back({ TRIANGLE_PRIMITIVE, i });
+		powers.push_back(power);
+	}
+
+	double totalPower = 0;
+
+	for (double power : powers)
+	{
+		totalPower += power;
+	}
+
+	double cumulativePower = 0;
+
+	for (double power : powers)
+	{
+		cumulativePower += power;
+
+		lights->probabilities.push_back(power / totalPower);
+		lights->cdf.push_back(cumulativePower / totalPower);
+	}
+
+	if (!lights->cdf.empty())
+	{
+		lights->cdf.back() = 1; // rounding could otherwise leave a gap at the end that no random number maps into
+	}
+}
+
+// Returns an index into lights.emitters and optionally the probability of having picked it. The table must not be empty
+int SampleLight(const LightTable& lights, Sampler* sampler, double* probability = nullptr)
+{
+	int lightIndex = 0;
+
+	// A single light doesn't need a random number
+	if (lights.emitters.size() > 1)
+	{
+		double random = sampler->NextDouble();
+
+		lightIndex = int(std::upper_bound(lights.cdf.begin(), lights.cdf.end(), random) - lights.cdf.begin());
+		lightIndex = int(Min(lightIndex, lights.emitters.size() - 1.0));
+	}
+
+	if (probability) *probability = lights.probabilities[lightIndex];
+
+	return lightIndex;
+}
+
+// Probability of SampleLight picking the primitive, 0 if it isn't in the table
+double LightProbability(const LightTable& lights, PrimitiveReference primitive)
+{
+	int lightIndex = -1;
+
+	if (primitive.type == SPHERE_PRIMITIVE) lightIndex = lights.sphereLightIndices[primitive.index];
+	else if (primitive.type == TRIANGLE_PRIMITIVE) lightIndex = lights.triangleLightIndices[primitive.index];
+
+	return (lightIndex < 0) ? 0 : lights.probabilities[lightIndex];
+}
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <emmintrin.h>
+
+#include "MathUtilities.cuh"
+#include "olcPixelGameEngine.h"
+
+// Filters on the linear HDR image and the pass that turns it into the pixels on the screen.
+// The image is kept as float planes, and the steps work on rows so the render threads can split them
+
+#define POST_PROCESSING_MARGIN 4 // columns on both sides of every row that repeat the edge pixel, so filters can load four pixels at once past the edges
+
+// Linear color and its luminance, the pixel x, y is at y * stride + POST_PROCESSING_MARGIN + x (see ColorPlanesIndex)
+struct ColorPlanes
+{
+	int width = 0;
+	int height = 0;
+	int stride = 0;
+
+	std::vector<float> r, g, b;
+	std::vector<float> luminance; // never negative, the median filter sorts by its bits
+};
+
+void ResizeColorPlanes(ColorPlanes* planes, int width, int height)
+{
+	planes->width = width;
+	planes->height = height;
+	planes->stride = POST_PROCESSING_MARGIN + (width + 3) / 4 * 4 + POST_PROCESSING_MARGIN;
+
+	size_t size = size_t(planes->stride) * height;
+
+	planes->r.assign(size, 0);
+	planes->g.assign(size, 0);
+	planes->b.assign(size, 0);
+	planes->luminance.assign(size, 0);
+}
+
+int ColorPlanesIndex(const ColorPlanes& planes, int x, int y)
+{
+	return y * planes.stride + POST_PROCESSING_MARGIN + x;
+}
+
+void SetPlanesColor(ColorPlanes* planes, int x, int y, Vec3D color)
+{
+	int index = ColorPlanesIndex(*planes, x, y);
+
+	planes->r[index] = float(color.x);
+	planes->g[index] = float(color.y);
+	planes->b[index] = float(color.z);
+	planes->luminance[index] = float(Max(0.2126 * color.x + 0.7152 * color.y + 0.0722 * color.z, 0));
+}
+
+Vec3D PlanesColor(const ColorPlanes& planes, int x, int y)
+{
+	int index = ColorPlanesIndex(planes, x, y);
+
+	return { planes.r[index], planes.g[index], planes.b[index] };
+}
+
+// Copies the edge pixels of the rows into their margins and the padding at the end, has to be called once the rows are written
+void ExtendColorPlanesRows(ColorPlanes* planes, int startRow, int endRow)
+{
+	std::vector<float>* channels[4] = { &planes->r, &planes->g, &planes->b, &planes->luminance };
+
+	for (int y = startRow; y < endRow; y++)
+	{
+		int rowStart = y * planes->stride;
+		int firstPixel = ColorPlanesIndex(*planes, 0, y);
+		int lastPixel = ColorPlanesIndex(*planes, planes->width - 1, y);
+
+		for (std::vector<float>* channel : channels)
+		{
+			std::fill(channel->begin() + rowStart, channel->begin() + firstPixel, (*channel)[firstPixel]);
+			std::fill(channel->begin() + lastPixel + 1, channel->begin() + rowStart + planes->stride, (*channel)[lastPixel]);
+		}
+	}
+}
+
+// Median selection networks: compare and swap the pairs in order, and the middle element ends up with the median.
+// The 5 and 9 tap ones are the known optimal ones, the 25 tap one is Batcher's odd-even merge sort for 32 elements
+// without the comparators that only touch the 7 missing elements or don't lead to the middle. All three are checked
+// against every input of zeros and ones, which is enough for comparator networks
+
+const int MEDIAN_NETWORK_5[][2] =
+{
+	{ 0, 1 }, { 3, 4 }, { 0, 3 }, { 1, 4 }, { 1, 2 }, { 2, 3 }, { 1, 2 }
+};
+
+const int MEDIAN_NETWORK_9[][2] =
+{
+	{ 1, 2 }, { 4, 5 }, { 7, 8 }, { 0, 1 }, { 3, 4 }, { 6, 7 }, { 1, 2 }, { 4, 5 },
+	{ 7, 8 }, { 0, 3 }, { 5, 8 }, { 4, 7 }, { 3, 6 }, { 1, 4 }, { 2, 5 }, { 4, 7 },
+	{ 4, 2 }, { 6, 4 }, { 4, 2 }
+};
+
+const int MEDIAN_NETWORK_25[][2] =
+{
+	{ 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 }, { 8, 9 }, { 10, 11 }, { 12, 13 }, { 14, 15 },
+	{ 16, 17 }, { 18, 19 }, { 20, 21 }, { 22, 23 }, { 0, 2 }, { 1, 3 }, { 4, 6 }, { 5, 7 },
+	{ 8, 10 }, { 9, 11 }, { 12, 14 }, { 13, 15 }, { 16, 18 }, { 17, 19 }, { 20, 22 }, { 21, 23 },
+	{ 1, 2 }, { 5, 6 }, { 9, 10 }, { 13, 14 }, { 17, 18 }, { 21, 22 }, { 0, 4 }, { 1, 5 },
+	{ 2, 6 }, { 3, 7 }, { 8, 12 }, { 9, 13 }, { 10, 14 }, { 11, 15 }, { 16, 20 }, { 17, 21 },
+	{ 18, 22 }, { 19, 23 }, { 2, 4 }, { 3, 5 }, { 10, 12 }, { 11, 13 }, { 18, 20 }, { 19, 21 },
+	{ 1, 2 }, { 3, 4 }, { 5, 6 }, { 9, 10 }, { 11, 12 }, { 13, 14 }, { 17, 18 }, { 19, 20 },
+	{ 21, 22 }, { 0, 8 }, { 1, 9 }, { 2, 10 }, { 3, 11 }, { 4, 12 }, { 5, 13 }, { 6, 14 },
+	{ 7, 15 }, { 16, 24 }, { 4, 8 }, { 5, 9 }, { 6, 10 }, { 7, 11 }, { 20, 24 }, { 2, 4 },
+	{ 3, 5 }, { 6, 8 }, { 7, 9 }, { 10, 12 }, { 11, 13 }, { 18, 20 }, { 19, 21 }, { 22, 24 },
+	{ 1, 2 }, { 3, 4 }, { 5, 6 }, { 7, 8 }, { 9, 10 }, { 11, 12 }, { 13, 14 }, { 17, 18 },
+	{ 19, 20 }, { 21, 22 }, { 23, 24 }, { 0, 16 }, { 1, 17 }, { 2, 18 }, { 3, 19 }, { 4, 20 },
+	{ 5, 21 }, { 6, 22 }, { 7, 23 }, { 8, 24 }, { 8, 16 }, { 9, 17 }, { 10, 18 }, { 11, 19 },
+	{ 12, 20 }, { 13, 21 }, { 6, 10 }, { 7, 11 }, { 12, 16 }, { 13, 17 }, { 10, 12 }, { 11, 13 },
+	{ 11, 12 }
+};
+
+// Replaces every pixel by the one with the median luminance among its taps: itself and its 4 neighbours (tapCount 5), the 3x3 (9) or the 5x5 block (25).
+// Removes fireflies smaller than half the taps. Four pixels go through the network at once, and the tap index is kept in the lowest 5 bits of the luminance,
+// which orders non-negative floats like their bits do, so the median comes out with where to copy the color from
+void MedianFilterRows(const ColorPlanes& source, ColorPlanes* destination, int tapCount, int startRow, int endRow)
+{
+	const int (*network)[2] = MEDIAN_NETWORK_9;
+	int comparatorCount = sizeof(MEDIAN_NETWORK_9) / sizeof(MEDIAN_NETWORK_9[0]);
+
+	int tapOffsetsX[25];
+	int tapOffsetsY[25];
+
+	if (tapCount == 5)
+	{
+		network = MEDIAN_NETWORK_5;
+		comparatorCount = sizeof(MEDIAN_NETWORK_5) / sizeof(MEDIAN_NETWORK_5[0]);
+
+		const int crossX[5] = { 0, -1, 1, 0, 0 };
+		const int crossY[5] = { 0, 0, 0, -1, 1 };
+
+		std::copy(crossX, crossX + 5, tapOffsetsX);
+		std::copy(crossY, crossY + 5, tapOffsetsY);
+	}
+	else
+	{
+		if (tapCount == 25)
+		{
+			network = MEDIAN_NETWORK_25;
+			comparatorCount = sizeof(MEDIAN_NETWORK_25) / sizeof(MEDIAN_NETWORK_25[0]);
+		}
+		else
+		{
+			tapCount = 9;
+		}
+
+		int size = (tapCount == 25) ? 5 : 3;
+
+		for (int i = 0; i < tapCount; i++)
+		{
+			tapOffsetsX[i] = i % size - size / 2;
+			tapOffsetsY[i] = i / size - size / 2;
+		}
+	}
+
+	const __m128i indexMask = _mm_set1_epi32(~31);
+
+	__m128 keys[25];
+	int tapRows[25]; // index of x = 0 of the row every tap reads in, plus its horizontal offset
+
+	for (int y = startRow; y < endRow; y++)
+	{
+		for (int i = 0; i < tapCount; i++)
+		{
+			int tapY = std::min(std::max(y + tapOffsetsY[i], 0), source.height - 1);
+
+			tapRows[i] = ColorPlanesIndex(source, tapOffsetsX[i], tapY);
+		}
+
+		for (int x = 0; x < source.width; x += 4)
+		{
+			for (int i = 0; i < tapCount; i++)
+			{
+				__m128i luminanceBits = _mm_castps_si128(_mm_loadu_ps(source.luminance.data() + tapRows[i] + x));
+
+				keys[i] = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(luminanceBits, indexMask), _mm_set1_epi32(i)));
+			}
+
+			for (int i = 0; i < comparatorCount; i++)
+			{
+				__m128 a = keys[network[i][0]];
+				__m128 b = keys[network[i][1]];
+
+				keys[network[i][0]] = _mm_min_ps(a, b);
+				keys[network[i][1]] = _mm_max_ps(a, b);
+			}
+
+			alignas(16) int medianKeys[4];
+			_mm_store_si128((__m128i*)medianKeys, _mm_castps_si128(keys[tapCount / 2]));
+
+			for (int lane = 0; lane < 4; lane++)
+			{
+				int sourceIndex = tapRows[medianKeys[lane] & 31] + x + lane;
+				int destinationIndex = ColorPlanesIndex(*destination, x + lane, y);
+
+				destination->r[destinationIndex] = source.r[sourceIndex];
+				destination->g[destinationIndex] = source.g[sourceIndex];
+				destination->b[destinationIndex] = source.b[sourceIndex];
+				destination->luminance[destinationIndex] = source.luminance[sourceIndex];
+			}
+		}
+	}
+
+	ExtendColorPlanesRows(destination, startRow, endRow);
+}
+
+// sRGB transfer curve for a linear value in [0, 1]
+double LinearToSrgb(double l)
+{
+	if (l <= 0.0031308)
+	{
+		return l * 12.92;
+	}
+
+	return 1.055 * pow(l, 1 / 2.4) - 0.055;
+}
+
+#define SRGB_ENCODER_MIN_EXPONENT -13 // values below 2^-13 are on the linear part of the curve, less than half a step of 8 bits
+#define SRGB_ENCODER_MANTISSA_BITS 4 // segments per power of two are 2^SRGB_ENCODER_MANTISSA_BITS, the curve is off by less than 0.03 of a step of 8 bits
+#define SRGB_ENCODER_SEGMENT_COUNT (2 - SRGB_ENCODER_MIN_EXPONENT * (1 << SRGB_ENCODER_MANTISSA_BITS)) // one for the values below, one that starts at 1
+
+// The sRGB curve as straight segments picked by the exponent and the top bits of the mantissa of a float, so it's a table lookup,
+// a multiply and an add instead of a pow. Optionally holds a blue noise mask that dithers the quantization to 8 bits
+struct SrgbEncoder
+{
+	float offsets[SRGB_ENCODER_SEGMENT_COUNT];
+	float slopes[SRGB_ENCODER_SEGMENT_COUNT];
+
+	// Added to the 8 bit value before it's truncated, in [0, 1). Empty rounds to nearest instead
+	std::vector<float> ditherThresholds;
+	int ditherSize = 0;
+};
+
+// Segment of the float bits, 0 for anything below 2^SRGB_ENCODER_MIN_EXPONENT
+int SrgbSegment(uint32_t bits)
+{
+	const int firstSegment = (127 + SRGB_ENCODER_MIN_EXPONENT) << SRGB_ENCODER_MANTISSA_BITS;
+
+	return std::max(int(bits >> (23 - SRGB_ENCODER_MANTISSA_BITS)) - firstSegment + 1, 0);
+}
+
+// ditherMask has ditherSize * ditherSize values in [0, 1) and tiles the screen, nullptr turns dithering off.
+// ditherSize has to be a multiple of 4 so OutputRows can load the thresholds of four pixels at once
+void BuildSrgbEncoder(SrgbEncoder* encoder, const std::vector<double>* ditherMask, int ditherSize)
+{
+	// Below 2^SRGB_ENCODER_MIN_EXPONENT the curve is linear
+	encoder->offsets[0] = 0;
+	encoder->slopes[0] = 12.92f;
+
+	for (int segment = 1; segment < SRGB_ENCODER_SEGMENT_COUNT; segment++)
+	{
+		// Chord between the ends of the segment, so the encoder is continuous
+		int exponent = SRGB_ENCODER_MIN_EXPONENT + ((segment - 1) >> SRGB_ENCODER_MANTISSA_BITS);
+		int mantissa = (segment - 1) & ((1 << SRGB_ENCODER_MANTISSA_BITS) - 1);
+
+		double start = ldexp(1 + mantissa / double(1 << SRGB_ENCODER_MANTISSA_BITS), exponent);
+		double end = ldexp(1 + (mantissa + 1) / double(1 << SRGB_ENCODER_MANTISSA_BITS), exponent);
+
+		double slope = (LinearToSrgb(end) - LinearToSrgb(start)) / (end - start);
+
+		encoder->offsets[segment] = float(LinearToSrgb(start) - slope * start);
+		encoder->slopes[segment] = float(slope);
+	}
+
+	encoder->ditherThresholds.clear();
+	encoder->ditherSize = 0;
+
+	if (ditherMask)
+	{
+		encoder->ditherThresholds.assign(ditherMask->begin(), ditherMask->end());
+		encoder->ditherSize = ditherSize;
+	}
+}
+
+// Last step on the rows, fused so the image is read once and written once: the optional blur, clamping to [0, 1], the sRGB curve,
+// quantization to 8 bits and packing into pixels. The blur is the GAUSSIAN_BLUR kernel, 0.75 for the pixel and 0.0625 for each of its 4 neighbours.
+// Everything but the lookup of the segments works on four pixels at once
+void OutputRows(const ColorPlanes& colors, const SrgbEncoder& encoder, bool blur, olc::Pixel* pixels, int startRow, int endRow)
+{
+	const std::vector<float>* channels[3] = { &colors.r, &colors.g, &colors.b };
+
+	const __m128 centerWeight = _mm_set1_ps(0.75f);
+	const __m128 neighbourWeight = _mm_set1_ps(0.0625f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 maxValue = _mm_set1_ps(255.0f);
+	const __m128 roundToNearest = _mm_set1_ps(0.5f);
+	const __m128i alpha = _mm_set1_epi32(int(0xFF000000));
+
+	bool dither = encoder.ditherSize > 0;
+
+	alignas(16) uint32_t segments[4];
+	alignas(16) uint32_t packedPixels[4];
+
+	for (int y = startRow; y < endRow; y++)
+	{
+		int row = ColorPlanesIndex(colors, 0, y);
+		int rowAbove = ColorPlanesIndex(colors, 0, std::max(y - 1, 0));
+		int rowBelow = ColorPlanesIndex(colors, 0, std::min(y + 1, colors.height - 1));
+
+		const float* ditherRow = dither ? &encoder.ditherThresholds[(y % encoder.ditherSize) * encoder.ditherSize] : nullptr;
+
+		for (int x = 0; x < colors.width; x += 4)
+		{
+			__m128 threshold = dither ? _mm_loadu_ps(ditherRow + x % encoder.ditherSize) : roundToNearest;
+
+			__m128i packed = alpha;
+
+			for (int channel = 0; channel < 3; channel++)
+			{
+				const float* values = channels[channel]->data();
+
+				__m128 color = _mm_loadu_ps(values + row + x);
+
+				if (blur)
+				{
+					__m128 neighbours = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(values + row + x - 1), _mm_loadu_ps(values + row + x + 1)),
+						_mm_add_ps(_mm_loadu_ps(values + rowAbove + x), _mm_loadu_ps(values + rowBelow + x)));
+
+					color = _mm_add_ps(_mm_mul_ps(color, centerWeight), _mm_mul_ps(neighbours, neighbourWeight));
+				}
+
+				color = _mm_min_ps(_mm_max_ps(color, zero), one);
+
+				_mm_store_si128((__m128i*)segments, _mm_castps_si128(color));
+
+				for (int lane = 0; lane < 4; lane++)
+				{
+					segments[lane] = SrgbSegment(segments[lane]);
+				}
+
+				__m128 offset = _mm_set_ps(encoder.offsets[segments[3]], encoder.offsets[segments[2]], encoder.offsets[segments[1]], encoder.offsets[segments[0]]);
+				__m128 slope = _mm_set_ps(encoder.slopes[segments[3]], encoder.slopes[segments[2]], encoder.slopes[segments[1]], encoder.slopes[segments[0]]);
+
+				__m128 srgb = _mm_add_ps(offset, _mm_mul_ps(slope, color));
+
+				// Truncated after adding the threshold, the clamp keeps the top of the curve from rounding past 8 bits
+				__m128i quantized = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(_mm_mul_ps(srgb, maxValue), threshold), maxValue));
+
+				packed = _mm_or_si128(packed, _mm_slli_epi32(quantized, 8 * channel));
+			}
+
+			// olc::Pixel is r, g, b, a in memory
+			if (x + 4 <= colors.width)
+			{
+				_mm_storeu_si128((__m128i*)(pixels + y * colors.width + x), packed);
+			}
+			else
+			{
+				_mm_store_si128((__m128i*)packedPixels, packed);
+
+				for (int lane = 0; x + lane < colors.width; lane++)
+				{
+					pixels[y * colors.width + x + lane].n = packedPixels[lane];
+				}
+			}
+		}
+	}
+}
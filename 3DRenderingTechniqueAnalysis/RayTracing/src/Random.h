@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+
+// Small PCG32 random number generator (O'Neill, "PCG: A Family of Simple Fast Space-Efficient Statistically Good Algorithms for Random Number Generation").
+// A new generator is seeded for every sample from its pixel, sample index and frame, and the bounces draw from it in order,
+// so the image only depends on the settings and not on which thread renders which tile or in what order
+
+struct RandomGenerator
+{
+	uint64_t state = 0;
+	uint64_t increment = 1;
+
+#if RANDOM_BENCHMARK == 1
+	uint64_t drawCount = 0;
+#endif
+
+	RandomGenerator(uint64_t seed, uint64_t stream = 0)
+	{
+		increment = (stream << 1) | 1;
+		NextUInt();
+		state += seed;
+		NextUInt();
+	}
+
+	uint32_t NextUInt()
+	{
+#if RANDOM_BENCHMARK == 1
+		drawCount++;
+#endif
+
+		uint64_t oldState = state;
+		state = oldState * 6364136223846793005ULL + increment;
+
+		uint32_t xorShifted = uint32_t(((oldState >> 18) ^ oldState) >> 27);
+		uint32_t rotation = uint32_t(oldState >> 59);
+
+		return (xorShifted >> rotation) | (xorShifted << ((-rotation) & 31));
+	}
+
+	// Uniform in [0, 1)
+	double NextDouble()
+	{
+		return NextUInt() * (1.0 / 4294967296.0);
+	}
+
+	// Uniform in [-1, 1)
+	double NextSignedDouble()
+	{
+		return NextDouble() * 2 - 1;
+	}
+};
+
+// SplitMix64 finalizer, spreads neighbouring seeds over the whole 64 bit range
+inline uint64_t MixBits(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBULL;
+	x ^= x >> 31;
+
+	return x;
+}
+
+inline RandomGenerator SampleRandomGenerator(int pixelIndex, int sampleIndex, int frameIndex)
+{
+	uint64_t seed = MixBits(uint64_t(pixelIndex) ^ MixBits(uint64_t(sampleIndex) ^ MixBits(uint64_t(frameIndex))));
+
+	return RandomGenerator(seed);
+}
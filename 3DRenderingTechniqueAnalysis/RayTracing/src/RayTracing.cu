@@ -1,26 +1,52 @@
 #define OLC_PGE_APPLICATION
 #define RAY_TRACER
 #define PATH_TRACING 0 // 0: distribution tracing, 1: path tracing
+#define SAMPLER 0 // 0: independent, 1: stratified, 2: Sobol, 3: blue noise dithered Sobol, can be switched with N
 
 // Startup settings (cannot be changed during runtime)
 #define ASYNC 1
-#define THREAD_COUNT 4
+#define THREAD_COUNT 0 // 0: one thread per hardware thread, can be overridden with the THREAD_COUNT environment variable
 #define SCREEN_WIDTH 900
 #define SCREEN_HEIGHT 720
 #define OFFSET_DISTANCE 0.0001
-#define SAMPLES_PER_PIXEL 1 // for path tracing
+#define SAMPLES_PER_PIXEL 1 // for path tracing, per frame when ADAPTIVE_SAMPLING is 0
+#define ADAPTIVE_SAMPLING 1 // spends more samples on the pixels that are still noisy
+#define ADAPTIVE_SAMPLE_BUDGET 1.0 // samples per frame as a multiple of the pixel count
+#define ADAPTIVE_MIN_SAMPLES 4 // pixels get one sample per frame until they have this many, so their variance can be estimated
+#define ADAPTIVE_MAX_SAMPLES 4096 // pixels stop sampling at this many accumulated samples
+#define ADAPTIVE_ERROR_THRESHOLD 0.02 // pixels stop sampling once their 95% confidence interval is smaller than this fraction of their brightness
+#define PROGRESSIVE_ACCUMULATION 1 // averages the frames rendered while the camera and scene are still
+#define FRAME_TIME_BUDGET 0 // milliseconds, the threads keep adding sample passes until it runs out and the frame is presented (0: one pass per frame)
+#define FRAME_BUFFER_COUNT 2 // HDR frames between the render loop and the screen, the next frame is traced while the last one is post processed (1: one after the other)
+#define POST_PROCESSING_CHUNK_ROWS 16 // rows of a post processing step the render threads take at a time, between their tiles or while they wait for a frame
 #define AMBIENT_LIGHT { 0, 0, 0 } //{ 27.5, 35, 55 } // sky light basically
-#define GAUSSIAN_BLUR 1 // blur for denoising
-#define MEDIAN_FILTER 0 // used for firefly reduction and denoising, bad for low spp
+#define DENOISER 1 // edge avoiding a-trous filter guided by the albedo, normal and depth of the first hits, see Denoiser.h
+#define GAUSSIAN_BLUR 0 // blur for denoising
+#define DITHERING 1 // blue noise dithering when the image is quantized to 8 bits, hides banding in dark gradients
+#define MEDIAN_FILTER 0 // firefly rejection on the linear colors before the denoiser, 0: off, 5: plus shaped, 9: 3x3, 25: 5x5 median of the luminance, bad for low spp
 #define MAX_COLOR_VALUE 1000000 // used for reducing fireflies, introduces bias
 #define MAX_BOUNCES 2 // For distribution ray tracing
-#define SAMPLES_PER_BOUNCE 10 // for distribution ray tracing
+#define PATH_MAX_BOUNCES 64 // for path tracing, most paths are ended earlier by russian roulette
+#define RUSSIAN_ROULETTE_DEPTH 3 // bounces before path tracing starts ending paths randomly
+#define DISTRIBUTION_SAMPLE_SCHEDULE { 16, 4, 1 } // light and reflection samples per hit at each bounce of distribution ray tracing, the last entry repeats for deeper bounces
+#define DISTRIBUTION_RAY_BUDGET 256 // rays per primary ray of distribution ray tracing (the schedule above traces 224), samples beyond it are pruned at random
+#define NAVIGATION_PREVIEW 1 // renders at 1/2, 1/4 or 1/8 resolution with fewer bounces while the player is moving
+#define NAVIGATION_TARGET_FRAME_TIME 50 // milliseconds, the preview resolution adapts to hold it
+#define NAVIGATION_MAX_BOUNCES 0 // for distribution ray tracing while moving
 #define WHITE_COLOR { 255, 255, 255 }
 #define REFRACTION_INDEX_AIR 1.0
+#define BVH_BENCHMARK 0 // prints rays/sec for growing triangle counts at startup
+#define TRIANGLE_BENCHMARK 0 // compares the baked triangle intersection with the reference TriangleIntersection_RT at startup
+#define RANDOM_BENCHMARK 0 // compares RandomGenerator with std::mt19937 and prints the random number generation share of a frame at startup
+#define NEE_BENCHMARK 0 // equal time RMSE of path tracing with and without next event estimation at startup, needs PATH_TRACING
+#define SAMPLER_BENCHMARK 0 // equal sample count RMSE of every sampler at startup
 
 #include <iostream>
 #include <random>
 #include <future>
+#include <thread>
+#include <algorithm>
+#include <sstream>
 
 #include <cuda_runtime.h>
 #include <device_launch_parameters.h>
@@ -30,16 +56,112 @@
 #include "MathUtilities.cuh"
 #include "WorldDatatypes.h"
 #include "ParseOBJ.h"
+#include "Scene.h"
+#include "BVH.h"
+#include "TileScheduler.h"
+#include "ThreadPool.h"
+#include "FrameQueue.h"
+#include "Random.h"
+#include "Sampler.h"
+#include "Lights.h"
+#include "Warps.h"
+#include "Denoiser.h"
+#include "PostProcessing.h"
 
 // Global variables
 
-Vec3D screenBuffer[SCREEN_HEIGHT * SCREEN_WIDTH];
+// The output pass of the post processing writes into g_outputPixels and then swaps it with g_finishedPixels.
+// OnUserUpdate swaps the finished pixels into the draw target on the main thread, so olc only ever uploads whole frames
+std::vector<olc::Pixel> g_outputPixels; // only touched by the post processing
+std::vector<olc::Pixel> g_finishedPixels; // the latest whole frame, or the pixels the draw target gave back
+bool g_newFrameFinished = false; // g_finishedPixels has a frame OnUserUpdate hasn't shown yet
+std::mutex g_finishedPixelsMutex; // guards g_finishedPixels and g_newFrameFinished
 
-Player g_player;
+// Linear HDR samples summed over the frames since the camera or scene last changed
+struct AccumulatedColor
+{
+	float r, g, b;
+	float luminanceSquaredSum; // for the variance of the pixel
+	int sampleCount;
+};
+
+AccumulatedColor g_accumulationBuffer[SCREEN_HEIGHT * SCREEN_WIDTH];
+int g_accumulatedFrameCount = 0; // frames already in g_accumulationBuffer, 0 starts over
+
+// Albedo, normal and depth of the first hits summed over the same samples, they guide the denoiser
+struct AccumulatedFeatures
+{
+	float albedoR, albedoG, albedoB;
+	float normalX, normalY, normalZ;
+	float depth;
+};
+
+AccumulatedFeatures g_featureBuffer[SCREEN_HEIGHT * SCREEN_WIDTH];
+
+// One frame on its way from the render loop to the screen. The render loop resolves the accumulation into it, so it can go on
+// tracing the next frame while the post processing thread filters this one. Sized in OnUserCreate
+struct PipelineFrame
+{
+	ColorPlanes planes[2]; // the mean of every pixel and its filtered copies, ping-ponged by the post processing stages
+	DenoiserBuffers denoiser; // the resolve fills in the features, the denoiser the illumination once the colors are filtered
+
+	bool preview; // the preview traced the colors itself, they aren't filtered
+	bool showSampleCounts;
+	std::vector<int> sampleCounts; // g_frameSampleCounts if showSampleCounts is set
+	double resolveTime; // seconds
+};
+
+PipelineFrame g_frames[FRAME_BUFFER_COUNT];
+FrameQueue g_frameQueue; // hands the indices of g_frames between the render loop and the post processing thread
+int g_tracedFrame = 0; // index of the frame the render loop is working on
+
+int g_frameSampleCounts[SCREEN_HEIGHT * SCREEN_WIDTH]; // how many samples each pixel takes in the current pass, planned by PlanAdaptiveSampling
+double g_relativeErrors[SCREEN_HEIGHT * SCREEN_WIDTH]; // relative error of the pixels PlanAdaptiveSampling still gives samples to, 0 for the rest
+
+int g_previewScale = 1; // 1: full resolution, 2, 4 or 8: one pixel traced per block of that size while the player is moving
+int g_navigationScale = 2; // preview scale adapted to NAVIGATION_TARGET_FRAME_TIME, kept between moves
+int g_maxBounces = MAX_BOUNCES; // NAVIGATION_MAX_BOUNCES during the preview
+
+std::chrono::steady_clock::time_point g_frameDeadline; // the threads stop taking tiles after this when FRAME_TIME_BUDGET is set
+std::atomic<long long> g_frameSampleCount{ 0 }; // samples taken since the start of the frame
+
+Player g_player; // moved by Controlls on the main thread
+Player g_renderCamera; // snapshot of g_player taken by the render loop at the start of every frame
+
+std::mutex g_cameraMutex; // guards g_player, g_cameraChanged and the options changed by Controlls
+bool g_cameraChanged = false; // set by the main thread, taken by the render loop with the snapshot
+std::atomic<bool> g_cancelFrame{ false }; // makes the render threads drop the full resolution frame they're working on
+
+std::thread g_renderLoopThread;
+std::atomic<bool> g_stopRenderLoop{ false };
 
 std::vector<Sphere> g_spheres;
 std::vector<Triangle> g_triangles;
 
+// Baked from g_spheres and g_triangles in PrepareScene
+SceneGeometry g_sceneGeometry; // hot data for intersection tests
+std::vector<TriangleShadingData> g_triangleShading; // cold data for shading the closest hit
+
+BVH g_bvh; // acceleration structure over g_spheres and g_triangles, rebuilt whenever they change
+
+LightTable g_lights; // spheres and triangles that emit light, sampled directly by both tracers
+
+TileScheduler g_tileScheduler(SCREEN_WIDTH, SCREEN_HEIGHT);
+
+ThreadPool g_renderThreads; // started in OnUserCreate, runs RenderTiles once per frame and the rows of the post processing in between
+
+std::thread g_postProcessThread; // turns the frames submitted to g_frameQueue into g_finishedPixels
+
+int g_frameIndex = 0; // part of the random seed of every sample, so consecutive frames get different noise
+
+SamplerType g_renderSampler = SamplerType(SAMPLER); // snapshot of Options::sampler taken by the render loop with the camera
+BlueNoiseMask g_blueNoiseMask; // built in OnUserCreate for the blue noise sampler
+SrgbEncoder g_srgbEncoder; // built in OnUserCreate, dithers with g_blueNoiseMask if DITHERING is on
+
+#if RANDOM_BENCHMARK == 1
+std::atomic<uint64_t> g_randomDrawCount{ 0 };
+#endif
+
 Ground g_ground;
 
 // Textures
@@ -57,14 +179,13 @@ olc::Sprite* g_tiledfloor_normalmap;
 olc::Sprite* g_worldmap_normalmap;
 olc::Sprite* g_bricks_normalmap;
 
-std::random_device seedEngine;
-std::uniform_real_distribution<> uniformDistribution(-1, 1);
-std::uniform_real_distribution<> uniform_zero_to_one(0, 1);
-
 // Ingame options (can be changed during runtime)
 namespace Options
 {
 	bool mcControls = true;
+	bool showSampleCounts = false; // debug view of g_frameSampleCounts, toggled with TAB
+	bool nextEventEstimation = true; // path tracing samples the emitters directly at diffuse bounces
+	SamplerType sampler = SamplerType(SAMPLER);
 }
 
 class Engine : public olc::PixelGameEngine
@@ -79,6 +200,7 @@ public:
 	{
 		//g_player = { { 1.5, 1.5, -2.064 }, { 1, ZERO_VEC3D }, TAU * 0.2f };
 		g_player = { { 1.5, 0.5, -0.5 }, { 1, ZERO_VEC3D }, TAU * 0.2f };
+		g_renderCamera = g_player;
 
 		g_basketball_texture = new olc::Sprite("../Assets/basketball.png");
 		g_planks_texture = new olc::Sprite("../Assets/planks.png");
@@ -217,413 +339,880 @@ public:
 	//ImportScene(&g_triangles, "../Assets/RubberDuck.obj", 0.4, { 0.8, 0.5, 0.5 });
 #endif
 
-		return true;
-	}
+		PrepareScene();
 
-	bool OnUserUpdate(float fElapsedTime) override
-	{
-		Timer timer("Rendering");
+		BuildBlueNoiseMask(&g_blueNoiseMask);
+
+#if DITHERING == 1
+		BuildSrgbEncoder(&g_srgbEncoder, &g_blueNoiseMask.values, BLUE_NOISE_SIZE);
+#else
+		BuildSrgbEncoder(&g_srgbEncoder, nullptr, 0);
+#endif
 
-		Controlls(fElapsedTime);
+		g_outputPixels.resize(SCREEN_WIDTH * SCREEN_HEIGHT);
+		g_finishedPixels.resize(SCREEN_WIDTH * SCREEN_HEIGHT);
 
-		StartThreads();
+		for (PipelineFrame& frame : g_frames)
+		{
+			ResizeColorPlanes(&frame.planes[0], SCREEN_WIDTH, SCREEN_HEIGHT);
+			ResizeColorPlanes(&frame.planes[1], SCREEN_WIDTH, SCREEN_HEIGHT);
+			ResizeDenoiserBuffers(&frame.denoiser, SCREEN_WIDTH, SCREEN_HEIGHT);
+		}
 
-#if GAUSSIAN_BLUR == 1
-		GaussianBlur();
+		g_frameQueue.Reset(FRAME_BUFFER_COUNT);
+
+#if ASYNC == 1
+		g_renderThreads.Start(RenderThreadCount(), [this](int threadIndex) { RenderTiles(threadIndex); });
 #endif
 
-#if MEDIAN_FILTER == 1
-		MedianFiltering();
+#if BVH_BENCHMARK == 1
+		BenchmarkBVH();
 #endif
 
-		for (int y = 0; y < SCREEN_HEIGHT; y++)
-		{
-			for (int x = 0; x < SCREEN_WIDTH; x++)
-			{
-				Vec3D pixelColor = screenBuffer[y * SCREEN_WIDTH + x];
+#if TRIANGLE_BENCHMARK == 1
+		BenchmarkTriangleIntersection();
+#endif
 
-				Draw(x, y, { uint8_t(pixelColor.x), uint8_t(pixelColor.y), uint8_t(pixelColor.z) });
-			}
-		}
+#if RANDOM_BENCHMARK == 1
+		BenchmarkRandom();
+#endif
 
-		std::cout << "\a" << std::endl;
+#if NEE_BENCHMARK == 1
+		BenchmarkNextEventEstimation();
+#endif
 
-		return true;
-	}
+#if SAMPLER_BENCHMARK == 1
+		BenchmarkSamplers();
+#endif
 
-	void StartThreads()
-	{
 #if ASYNC == 1
-		// Screen split up into 4 quadrants running in parallell on seperate threads
+		// Rendering runs on its own thread so input stays responsive during long frames,
+		// and the post processing on another one so the next frame is traced in the meantime
+		g_postProcessThread = std::thread(&Engine::PostProcessLoop, this);
+		g_renderLoopThread = std::thread(&Engine::RenderLoop, this);
+#endif
 
-		std::future<void> returnValues[THREAD_COUNT];
+		return true;
+	}
 
-		for (int i = 0; i < THREAD_COUNT; i++)
+	bool OnUserUpdate(float fElapsedTime) override
+	{
 		{
-			int startX = i * ceil(SCREEN_WIDTH / double(THREAD_COUNT));
-			int endX = (i + 1) * ceil(SCREEN_WIDTH / double(THREAD_COUNT));
+			std::lock_guard<std::mutex> lock(g_cameraMutex);
 
-			if (startX >= SCREEN_WIDTH)
+			if (Controlls(fElapsedTime))
 			{
-				break;
+				// The frame in flight is rendered from an old camera, the render loop starts over with a new snapshot
+				g_cameraChanged = true;
+				g_cancelFrame = true;
 			}
+		}
 
-			endX = Min(endX, SCREEN_WIDTH);
+#if ASYNC == 0
+		RenderFrame();
+#endif
 
-			std::mt19937 randomEngine(seedEngine());
+		// The draw target gets the pixels of the finished frame and gives its old ones back to be written next
+		{
+			std::lock_guard<std::mutex> lock(g_finishedPixelsMutex);
 
-			returnValues[i] = std::async(std::launch::async, &Engine::RayTracing, this, startX, endX, randomEngine);
+			if (g_newFrameFinished)
+			{
+				std::swap(GetDrawTarget()->pColData, g_finishedPixels);
+				g_newFrameFinished = false;
+			}
 		}
-#else
-		std::mt19937 randomEngine(seedEngine());
-		RayTracing(0, SCREEN_WIDTH, randomEngine);
-#endif
-	}
 
-private:
-	// Defined in Controlls.h
-	void Controlls(float fElapsedTime);
+		return true;
+	}
 
-	void RayTracing(int startX, int endX, std::mt19937 randomEngine)
+	bool OnUserDestroy() override
 	{
-		const double zFar = (SCREEN_WIDTH * 0.5) / tan(g_player.FOV * 0.5);
+		// Also wakes the render loop if it's waiting for a free frame
+		g_frameQueue.Stop();
 
-		for (double y = -SCREEN_HEIGHT * 0.5 + 0.5; y < SCREEN_HEIGHT * 0.5 + 0.5; y++)
+		if (g_renderLoopThread.joinable())
 		{
-			for (double x = -SCREEN_WIDTH * 0.5 + 0.5 + startX; x < -SCREEN_WIDTH * 0.5 + 0.5 + endX; x++)
-			{
-				Vec3D v_direction = { x, y, zFar };
+			g_stopRenderLoop = true;
+			g_cancelFrame = true;
+			g_renderLoopThread.join();
+		}
 
-				Vec3D v_orientedDirection = QuaternionMultiplication(g_player.q_orientation, { 0, v_direction }, QuaternionConjugate(g_player.q_orientation)).vecPart;
+		if (g_postProcessThread.joinable())
+		{
+			g_postProcessThread.join();
+		}
 
-				int screenX = x + SCREEN_WIDTH * 0.5;
-				int screenY = SCREEN_HEIGHT - (y + SCREEN_HEIGHT * 0.5);
+		g_renderThreads.Stop();
 
-				Vec3D pixelColor = ZERO_VEC3D;
+		return true;
+	}
 
-				for (int i = 0; i < SAMPLES_PER_PIXEL; i++)
-				{
-#if PATH_TRACING == 1
-					// For anti-aliasing
-					Vec3D v_jitteredDirection = AddVec3D(v_orientedDirection, RandomVec_InUnitSphere(&randomEngine));
-					NormalizeVec3D(&v_jitteredDirection);
+	void RenderLoop()
+	{
+		while (!g_stopRenderLoop)
+		{
+			RenderFrame();
+		}
+	}
 
-					AddToVec3D(&pixelColor, RenderPixel(g_player.coords, v_jitteredDirection, &randomEngine));
-#else
-					NormalizeVec3D(&v_orientedDirection);
+	// Post processes the frames in the order the render loop submits them, until the queue is stopped
+	void PostProcessLoop()
+	{
+		while (true)
+		{
+			int frame = g_frameQueue.AcquireSubmitted();
 
-					AddToVec3D(&pixelColor, RenderPixel(g_player.coords, v_orientedDirection, &randomEngine));
-#endif
-				}
+			if (frame < 0) break;
 
-				ScaleVec3D(&pixelColor, 1 / double(SAMPLES_PER_PIXEL));
+			PostProcess(&g_frames[frame]);
 
-				pixelColor.x = Min(pixelColor.x, 1.0);
-				pixelColor.y = Min(pixelColor.y, 1.0);
-				pixelColor.z = Min(pixelColor.z, 1.0);
+			g_frameQueue.Free(frame);
+		}
+	}
 
-				//ScaleVec3D(&pixelColor, 1.0f / 255);
+	// Renders one frame from a snapshot of the camera into a free frame of g_frames and hands it to the post processing,
+	// which presents it in g_finishedPixels. Waits for a free frame first if the post processing is behind
+	void RenderFrame()
+	{
+#if ASYNC == 1
+		g_tracedFrame = g_frameQueue.AcquireFree();
 
-				pixelColor = { LINEAR_TO_SRGB(pixelColor.x), LINEAR_TO_SRGB(pixelColor.y), LINEAR_TO_SRGB(pixelColor.z) };
+		if (g_tracedFrame < 0) return;
+#endif
 
-				ScaleVec3D(&pixelColor, 255.0);
+		Timer timer("Rendering");
 
-				screenBuffer[screenY * SCREEN_WIDTH + screenX] = pixelColor;
-			}
+		bool playerMoved;
+		bool samplerChanged;
+		bool showSampleCounts;
 
-			std::cout << ((y + SCREEN_HEIGHT * 0.5f) / SCREEN_HEIGHT) * 100 << "%" << '\n';
-		}
-	}
+		{
+			std::lock_guard<std::mutex> lock(g_cameraMutex);
 
-	Vec3D RenderPixel(Vec3D v_start, Vec3D v_direction, std::mt19937* randomEngine)
-	{
-		Vec3D v_intersection = ZERO_VEC3D;
-		Vec3D v_textureColor = ZERO_VEC3D;
-		Quaternion q_surfaceNormal = IDENTITY_QUATERNION;
-		Material material;
+			g_renderCamera = g_player;
+			playerMoved = g_cameraChanged;
+			g_cameraChanged = false;
+			g_cancelFrame = false;
 
-		bool intersectionExists = NextIntersection(v_start, v_direction, &v_intersection, &v_textureColor, &q_surfaceNormal, &material);
+			// The accumulation starts over with a new sampler, so the image shows it on its own
+			samplerChanged = (g_renderSampler != Options::sampler);
+			g_renderSampler = Options::sampler;
 
-		if (intersectionExists)
-		{
-#if PATH_TRACING == 1
-			v_textureColor = CalculateLighting_PathTracing(
-				v_textureColor, material, q_surfaceNormal, v_direction, v_intersection, { 1, 1, 1 }, randomEngine
-			);
-#else
-			v_textureColor = CalculateLighting_DistributionTracing(
-				v_textureColor, material, q_surfaceNormal, v_direction, v_intersection, 0, randomEngine
-			);
-#endif
+			showSampleCounts = Options::showSampleCounts;
 		}
 
-		return v_textureColor;
-	}
+		bool sceneChanged = false;
 
-	void MedianFilter()
-	{
-		auto AddColorToVector = [](std::vector<Vec3D>* colors, int x, int y)
 		{
-			if (x >= 0 && x < SCREEN_WIDTH && y >= 0 && y < SCREEN_HEIGHT)
+			// Prepare the scene again if an asynchronous ImportScene has added triangles since the last frame
+			std::lock_guard<std::mutex> lock(trianglesMutex);
+
+			if (g_bvh.primitives.size() != g_spheres.size() + g_triangles.size())
 			{
-				colors->push_back(screenBuffer[y * SCREEN_WIDTH + x]);
+				PrepareScene();
+				sceneChanged = true;
 			}
-		};
+		}
 
-		auto ColorSize = [](Vec3D color)
+		if (playerMoved || sceneChanged || samplerChanged || PROGRESSIVE_ACCUMULATION == 0)
 		{
-			return Max(color.x, Max(color.y, color.z));
-		};
+			ResetAccumulation();
+		}
 
-		auto MedianColor = [ColorSize](std::vector<Vec3D>* colors)
-		{
-			for (int i = 0; i < colors->size(); i++)
-			{
-				for (int j = 0; j < colors->size() - 1; j++)
-				{
-					if (ColorSize(colors->at(j)) > ColorSize(colors->at(j + 1)))
-					{
-						SwapVec3D(&(colors->at(j)), &(colors->at(j + 1)));
-					}
-				}
-			}
+		// Lower resolution and fewer bounces while moving, full resolution and accumulation once the player stops
+		g_previewScale = (playerMoved && NAVIGATION_PREVIEW == 1) ? g_navigationScale : 1;
+		g_maxBounces = (g_previewScale > 1) ? NAVIGATION_MAX_BOUNCES : MAX_BOUNCES;
 
-			return colors->at(colors->size() / 2);
-		};
+		auto renderStart = std::chrono::steady_clock::now();
 
-		Vec3D* screenBufferCopy = new Vec3D[SCREEN_HEIGHT * SCREEN_WIDTH];
+		StartThreads();
+
+		std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - renderStart;
 
-		for (int y = 0; y < SCREEN_HEIGHT; y++)
+		if (g_previewScale == 1 && g_cancelFrame)
 		{
-			for (int x = 0; x < SCREEN_WIDTH; x++)
-			{
-				std::vector<Vec3D> colors;
+			// The accumulation buffer is reset with the next snapshot, so the partial frame is just dropped
+			std::cout << "Frame cancelled after " << renderTime.count() * 1000.0 << "ms" << std::endl;
 
-				AddColorToVector(&colors, x, y);
-				AddColorToVector(&colors, x + 1, y);
-				AddColorToVector(&colors, x - 1, y);
-				AddColorToVector(&colors, x, y + 1);
-				AddColorToVector(&colors, x, y - 1);
+#if ASYNC == 1
+			g_frameQueue.Free(g_tracedFrame);
+#endif
 
-				screenBufferCopy[y * SCREEN_WIDTH + x] = MedianColor(&colors);
-			}
+			return;
 		}
 
-		for (int y = 0; y < SCREEN_HEIGHT; y++)
+		if (g_previewScale > 1)
 		{
-			for (int x = 0; x < SCREEN_WIDTH; x++)
+			// Halving the scale quadruples the traced pixels, so only go finer if that would still fit the target
+			double targetTime = NAVIGATION_TARGET_FRAME_TIME / 1000.0;
+
+			if (renderTime.count() > targetTime && g_navigationScale < 8)
+			{
+				g_navigationScale *= 2;
+			}
+			else if (renderTime.count() * 4 < targetTime && g_navigationScale > 2)
 			{
-				screenBuffer[y * SCREEN_WIDTH + x] = screenBufferCopy[y * SCREEN_WIDTH + x];
+				g_navigationScale /= 2;
 			}
+
+			std::cout << "Preview at 1/" << g_previewScale << " resolution" << std::endl;
+		}
+		else
+		{
+			g_accumulatedFrameCount++;
+
+			std::cout << "Accumulated frames: " << g_accumulatedFrameCount << std::endl;
+		}
+
+		// The screen keeps the last image if nothing was sampled
+		if (g_frameSampleCount > 0)
+		{
+			ResolveFrame(&g_frames[g_tracedFrame], g_previewScale > 1, showSampleCounts);
+
+#if ASYNC == 1
+			g_frameQueue.Submit(g_tracedFrame);
+#else
+			PostProcess(&g_frames[g_tracedFrame]);
+#endif
+		}
+		else
+		{
+#if ASYNC == 1
+			g_frameQueue.Free(g_tracedFrame);
+#endif
+
+			// Nothing left to sample, don't spin while waiting for the player to move
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
 		}
 
-		delete[] screenBufferCopy;
+		g_frameIndex++;
 	}
 
-	void GaussianBlur()
+	void StartThreads()
 	{
-		auto WeightedPixel = [](double weight, int x, int y)
-		{
-			Vec3D weightedPixel = ZERO_VEC3D;
+		// Screen split up into tiles which the render threads take from a work stealing scheduler,
+		// so no thread sits idle while another one is still working on an expensive part of the image
 
-			if (x >= 0 && x < SCREEN_WIDTH && y >= 0 && y < SCREEN_HEIGHT)
-			{
-				weightedPixel = VecScalarMultiplication3D(screenBuffer[y * SCREEN_WIDTH + x], weight);
-			}
+#if ASYNC == 1
+		int threadCount = int(g_renderThreads.threads.size());
+#else
+		int threadCount = 1;
+#endif
 
-			return weightedPixel;
-		};
+		bool preview = g_previewScale > 1;
 
-#define KERNEL_SIZE 3
+		auto frameStart = std::chrono::steady_clock::now();
 
-		double gaussianKernel[KERNEL_SIZE * KERNEL_SIZE] =
-		{
-			0.0000, 0.0625, 0.0000,
-			0.0625, 0.7500, 0.0625,
-			0.0000, 0.0625, 0.0000,
-		};
+		// The preview always renders one whole pass
+		g_frameDeadline = preview ? std::chrono::steady_clock::time_point::max() : frameStart + std::chrono::milliseconds(FRAME_TIME_BUDGET);
+		g_frameSampleCount = 0;
+		g_tileScheduler.stolenTileCount = 0;
 
-		Vec3D* screenBufferCopy = new Vec3D[SCREEN_HEIGHT * SCREEN_WIDTH];
+		int finishedPassCount = 0;
+		double totalBusyTime = 0;
 
-		for (int y = 0; y < SCREEN_HEIGHT; y++)
+		// Each pass takes the samples planned by PlanAdaptiveSampling. With a FRAME_TIME_BUDGET the passes repeat until
+		// the deadline, and a pass that is still unfinished at the deadline is continued in the next frame
+		do
 		{
-			for (int x = 0; x < SCREEN_WIDTH; x++)
+			if (g_tileScheduler.remainingTileCount == 0)
 			{
-				Vec3D blurredPixel = ZERO_VEC3D;
-
-				for (int i = 0; i < 3; i++)
+				if (!preview)
 				{
-					for (int j = 0; j < 3; j++)
-					{
-						AddToVec3D(&blurredPixel, WeightedPixel(gaussianKernel[i * KERNEL_SIZE + j], x + j - KERNEL_SIZE / 2, y + i - KERNEL_SIZE / 2));
-					}
+					PlanAdaptiveSampling();
 				}
 
-				screenBufferCopy[y * SCREEN_WIDTH + x] = blurredPixel;
+				g_tileScheduler.Reset(threadCount);
 			}
-		}
 
-		for (int y = 0; y < SCREEN_HEIGHT; y++)
-		{
-			for (int x = 0; x < SCREEN_WIDTH; x++)
+#if ASYNC == 1
+			g_renderThreads.RunFrame();
+
+			for (double busyTime : g_renderThreads.busyTimes)
 			{
-				screenBuffer[y * SCREEN_WIDTH + x] = screenBufferCopy[y * SCREEN_WIDTH + x];
+				totalBusyTime += busyTime;
 			}
-		}
+#else
+			RenderTiles(0);
+#endif
+
+			if (g_tileScheduler.remainingTileCount == 0)
+			{
+				finishedPassCount++;
+			}
+		} while (!preview && !g_cancelFrame && FRAME_TIME_BUDGET > 0 && std::chrono::steady_clock::now() < g_frameDeadline);
+
+		std::chrono::duration<double> frameTime = std::chrono::steady_clock::now() - frameStart;
 
-		delete[] screenBufferCopy;
+		std::cout << "Samples this frame: " << g_frameSampleCount << " (" << g_frameSampleCount / double(SCREEN_WIDTH * SCREEN_HEIGHT) << " per pixel), "
+			<< finishedPassCount << " passes finished" << std::endl;
+
+#if ASYNC == 1
+		// How much of the frame the threads spent rendering instead of waiting for the slowest one
+		std::cout << "Thread utilization: " << 100 * totalBusyTime / (frameTime.count() * threadCount) << "% on " << threadCount << " threads, "
+			<< g_tileScheduler.stolenTileCount << " tiles stolen" << std::endl;
+#endif
 	}
 
-	double LINEAR_TO_SRGB(double l)
+private:
+	// Defined in Controlls.h
+	bool Controlls(float fElapsedTime);
+
+	// Defined in Benchmarks.h
+	void WithBenchmarkScene(const std::function<void()>& benchmark);
+	void BenchmarkBVH();
+	void BenchmarkTriangleIntersection();
+	void BenchmarkRandom();
+	void BenchmarkNextEventEstimation();
+	void BenchmarkSamplers();
+
+	// Bakes the scene, builds the BVH and the light table, has to be called whenever g_spheres or g_triangles change
+	void PrepareScene()
 	{
-		if (l <= 0.0031308)
-		{
-			return l * 12.92;
-		}
-
-		return 1.055 * pow(l, 0.41666) - 0.055;
+		BakeScene(&g_sceneGeometry, &g_triangleShading, g_spheres, g_triangles);
+		BuildBVH(&g_bvh, g_spheres, g_triangles);
+		BuildLightTable(&g_lights, g_spheres, g_triangles);
 	}
 
-	bool GroundIntersection_RT(Vec3D v_start, Vec3D v_direction,
-		Vec3D* v_intersection = nullptr, Vec3D* v_intersectionColor = nullptr, Quaternion* q_surfaceNormal = nullptr)
+	void ResetAccumulation()
 	{
-		if (v_direction.y >= 0 || v_start.y < g_ground.level)
-		{
-			return false;
-		}
+		g_accumulatedFrameCount = 0;
 
-		ScaleVec3D(&v_direction, (g_ground.level - v_start.y) / v_direction.y);
+		std::fill(std::begin(g_accumulationBuffer), std::end(g_accumulationBuffer), AccumulatedColor{ 0, 0, 0, 0, 0 });
+		std::fill(std::begin(g_featureBuffer), std::end(g_featureBuffer), AccumulatedFeatures{ 0, 0, 0, 0, 0, 0, 0 });
 
-		Vec3D rayGroundIntersection = AddVec3D(v_start, v_direction);
+		// A pass interrupted by the frame deadline would be planned for the old image
+		g_tileScheduler.Cancel();
+	}
 
-		if (v_intersection != nullptr)
-		{
-			*v_intersection = rayGroundIntersection;
-		}
+	// THREAD_COUNT from the environment if it's set, otherwise the THREAD_COUNT setting, otherwise one per hardware thread
+	int RenderThreadCount()
+	{
+		int threadCount = THREAD_COUNT;
 
-		if (q_surfaceNormal != nullptr)
+		if (const char* environmentThreadCount = std::getenv("THREAD_COUNT"))
 		{
-			*q_surfaceNormal = { 1, { 0, 1, 0 } };
+			threadCount = atoi(environmentThreadCount);
 		}
 
-		if (v_intersectionColor == nullptr)
+		if (threadCount <= 0)
 		{
-			// Don't return any color
-			return true;
+			threadCount = Max(int(std::thread::hardware_concurrency()), 1);
 		}
 
-		*v_intersectionColor = WHITE_COLOR;
-
-		if (g_ground.texture != nullptr || g_ground.normalMap != nullptr)
-		{
-			double signedTextureWidth = (g_ground.textureCorner2.x - g_ground.textureCorner1.x) * g_ground.textureScalar;
-			double signedTextureHeight = (g_ground.textureCorner2.y - g_ground.textureCorner1.y) * g_ground.textureScalar;
+		return threadCount;
+	}
 
-			double t1 = fmod(rayGroundIntersection.x, signedTextureWidth) / signedTextureWidth;
-			double t2 = fmod(rayGroundIntersection.z, signedTextureHeight) / signedTextureHeight;
+	// Renders tiles until the scheduler runs out of them
+	void RenderTiles(int threadIndex)
+	{
+		Tile tile;
 
-			// if the t values are negative, we need to flip them around the center of the texture and make them positive
-			if (t1 < 0) t1 += 1;
-			if (t2 < 0) t2 += 1;
+		for (int tileCount = 0; g_tileScheduler.NextTile(threadIndex, &tile); tileCount++)
+		{
+			// The post processing of the last frame goes first, the screen waits for it
+			while (g_renderThreads.RunSharedChunk())
+			{
+			}
 
-			double textureX = Lerp(g_ground.textureCorner1.x, g_ground.textureCorner2.x, t1);
-			double textureY = Lerp(g_ground.textureCorner1.y, g_ground.textureCorner2.y, t2);
+			g_frameSampleCount += (g_previewScale > 1) ? RayTracingPreview(tile) : RayTracing(tile);
 
-			if (g_ground.texture != nullptr)
+			// Every thread renders at least one tile per frame, so the image makes progress even if a tile takes longer than the budget
+			if (FRAME_TIME_BUDGET > 0 && std::chrono::steady_clock::now() >= g_frameDeadline)
 			{
-				olc::Pixel texelColor = g_ground.texture->Sample(textureX, textureY);
-
-				*v_intersectionColor = { double(texelColor.r), double(texelColor.g), double(texelColor.b) };
+				break;
 			}
-			if (g_ground.normalMap != nullptr)
-			{
-				olc::Pixel normalMapColor = g_ground.normalMap->Sample(textureX, textureY);
 
-				// Converting the color in the normalMap to an actual unit vector
-				q_surfaceNormal->vecPart = ReturnNormalizedVec3D({ double(normalMapColor.r) * 2 - 255.0f, double(normalMapColor.b) * 2 - 255.0f, double(normalMapColor.g) * 2 - 255.0f });
+			// Previews are short, only full resolution frames are worth cancelling
+			if (g_previewScale == 1 && g_cancelFrame)
+			{
+				break;
 			}
 		}
-
-		return true;
 	}
 
-	// Ray tracing for spheres
-	bool SphereIntersection_RT(Sphere sphere, Vec3D v_start, Vec3D v_direction,
-		Vec3D* v_intersection = nullptr, Vec3D* v_intersectionColor = nullptr, Quaternion* q_surfaceNormal = nullptr)
+	// Returns how many samples were taken
+	int RayTracing(const Tile& tile)
 	{
-		double dxdz = v_direction.x / v_direction.z;
-		double dydz = v_direction.y / v_direction.z;
-
-		double a = dxdz * dxdz + dydz * dydz + 1;
-		
-		double b = 
-			2 * dxdz * (v_start.x - sphere.coords.x) +
-			2 * dydz * (v_start.y - sphere.coords.y) +
-			2 * (v_start.z - sphere.coords.z);
+		int tileSampleCount = 0;
 
-		double c = 
-			(v_start.x - sphere.coords.x) * (v_start.x - sphere.coords.x) +
-			(v_start.y - sphere.coords.y) * (v_start.y - sphere.coords.y) +
-			(v_start.z - sphere.coords.z) * (v_start.z - sphere.coords.z) - sphere.radius * sphere.radius;
+		for (int screenY = tile.startY; screenY < tile.endY; screenY++)
+		{
+			for (int screenX = tile.startX; screenX < tile.endX; screenX++)
+			{
+				// Checked for every pixel so a camera change doesn't have to wait for the rest of the tile
+				if (g_cancelFrame)
+				{
+					return tileSampleCount;
+				}
 
-		// ISAK: There wasn't any need to recalculate this multiple times
-		double rootContent = b * b - 4 * a * c;
+				Vec3D v_orientedDirection = PrimaryRayDirection(screenX + 0.5, screenY + 0.5);
 
-		// There exists no intersections (no real answer)
-		if (rootContent < 0) return false;
+				int pixelIndex = screenY * SCREEN_WIDTH + screenX;
 
-		double z1 = (-b + sqrt(rootContent)) / (2 * a);
-		double z2 = (-b - sqrt(rootContent)) / (2 * a);
+				AccumulatedColor& accumulatedColor = g_accumulationBuffer[pixelIndex];
 
-		Vec3D v_alternative1 = { z1 * dxdz, z1 * dydz, z1 };
-		AddToVec3D(&v_alternative1, v_start);
+				for (int i = 0; i < g_frameSampleCounts[pixelIndex]; i++)
+				{
+					Vec3D sampleColor = ZERO_VEC3D;
+					SurfaceFeatures features;
 
-		Vec3D v_alternative2 = { z2 * dxdz, z2 * dydz, z2 };
-		AddToVec3D(&v_alternative2, v_start);
+					Sampler sampler(g_renderSampler, screenX, screenY, pixelIndex, accumulatedColor.sampleCount, g_frameIndex, &g_blueNoiseMask);
 
-		// Check which intersection is the closest and choose that one
-		double dist1 = DistanceSquared3D(v_alternative1, v_start);
-		double dist2 = DistanceSquared3D(v_alternative2, v_start);
+#if PATH_TRACING == 1
+					// For anti-aliasing
+					Vec3D v_jitteredDirection = AddVec3D(v_orientedDirection, RandomVec_InUnitSphere(&sampler));
+					NormalizeVec3D(&v_jitteredDirection);
 
-		bool dist1Closest = dist1 < dist2;
+					sampleColor = RenderPixel(g_renderCamera.coords, v_jitteredDirection, &sampler, &features);
+#else
+					NormalizeVec3D(&v_orientedDirection);
 
-		Vec3D v_correctHit = dist1Closest ? v_alternative1 : v_alternative2;
-		Vec3D v_otherHit = dist1Closest ? v_alternative2 : v_alternative1;
+					sampleColor = RenderPixel(g_renderCamera.coords, v_orientedDirection, &sampler, &features);
+#endif
 
-		// Check if the intersection is behind the ray. If so, choose the other one.
-		if (DotProduct3D(SubtractVec3D(v_correctHit, v_start), v_direction) < 0)
-		{
-			v_correctHit = v_otherHit;
+#if RANDOM_BENCHMARK == 1
+					g_randomDrawCount += sampler.randomGenerator.drawCount;
+#endif
 
-			// Check if the other intersection is behind the ray. If so, discard it.
-			if (DotProduct3D(SubtractVec3D(v_correctHit, v_start), v_direction) < 0) return false;
+					// Add the sample to the accumulation buffer
+					double luminance = Luminance(sampleColor);
+
+					accumulatedColor.r += float(sampleColor.x);
+					accumulatedColor.g += float(sampleColor.y);
+					accumulatedColor.b += float(sampleColor.z);
+					accumulatedColor.luminanceSquaredSum += float(luminance * luminance);
+					accumulatedColor.sampleCount++;
+					tileSampleCount++;
+
+					AccumulatedFeatures& accumulatedFeatures = g_featureBuffer[pixelIndex];
+
+					accumulatedFeatures.albedoR += float(features.albedo.x);
+					accumulatedFeatures.albedoG += float(features.albedo.y);
+					accumulatedFeatures.albedoB += float(features.albedo.z);
+					accumulatedFeatures.normalX += float(features.normal.x);
+					accumulatedFeatures.normalY += float(features.normal.y);
+					accumulatedFeatures.normalZ += float(features.normal.z);
+					accumulatedFeatures.depth += float(features.depth);
+				}
+			}
 		}
 
-		// Checks whether or not to return the intersection
-		if (v_intersection != nullptr)
+		return tileSampleCount;
+	}
+
+	double Luminance(Vec3D color)
+	{
+		return 0.2126 * color.x + 0.7152 * color.y + 0.0722 * color.z;
+	}
+
+	// Decides how many samples every pixel takes this frame. Pixels below ADAPTIVE_MIN_SAMPLES get one,
+	// the rest of the budget is split between the pixels whose confidence interval is still too wide, in proportion to it
+	void PlanAdaptiveSampling()
+	{
+#if ADAPTIVE_SAMPLING == 1
+		const int pixelCount = SCREEN_WIDTH * SCREEN_HEIGHT;
+
+		double plannedSampleCount = 0;
+		double totalError = 0;
+
+		for (int i = 0; i < pixelCount; i++)
 		{
-			*v_intersection = v_correctHit;
+			const AccumulatedColor& accumulatedColor = g_accumulationBuffer[i];
+
+			int sampleCount = accumulatedColor.sampleCount;
+
+			g_frameSampleCounts[i] = 0;
+			g_relativeErrors[i] = 0;
+
+			if (sampleCount < ADAPTIVE_MIN_SAMPLES)
+			{
+				g_frameSampleCounts[i] = 1;
+				plannedSampleCount++;
+				continue;
+			}
+
+			if (sampleCount >= ADAPTIVE_MAX_SAMPLES)
+			{
+				continue;
+			}
+
+			double meanLuminance = Luminance({ accumulatedColor.r, accumulatedColor.g, accumulatedColor.b }) / sampleCount;
+			double variance = Max((accumulatedColor.luminanceSquaredSum / sampleCount - meanLuminance * meanLuminance) * sampleCount / (sampleCount - 1), 0.0);
+
+			// Half width of the 95% confidence interval of the mean, relative to the brightness of the pixel
+			// (the displayed color is clamped to 1, and very dark pixels would never converge relative to their own brightness).
+			// It doesn't go below 1 / n: a few equal samples have no variance but can still have missed a rare light path,
+			// like four black samples in a penumbra, so those pixels keep sampling until ADAPTIVE_ERROR_THRESHOLD allows them to stop
+			double confidenceInterval = 1.96 * sqrt(variance / sampleCount);
+			double relativeError = Max(confidenceInterval / Clamp(meanLuminance, 0.01, 1.0), 1.0 / sampleCount);
+
+			if (relativeError > ADAPTIVE_ERROR_THRESHOLD)
+			{
+				g_relativeErrors[i] = relativeError;
+				totalError += relativeError;
+			}
 		}
 
-		// Calculating the normal of the sphere (without normalmap)
-		Vec3D v_normal = SubtractVec3D(v_correctHit, sphere.coords);
-		NormalizeVec3D(&v_normal);
+		double remainingSampleCount = Max(ADAPTIVE_SAMPLE_BUDGET * pixelCount - plannedSampleCount, 0.0);
 
-		if (q_surfaceNormal != nullptr)
+		if (totalError > 0)
 		{
-			q_surfaceNormal->vecPart = v_normal;
-			q_surfaceNormal->realPart = 1;
+			for (int i = 0; i < pixelCount; i++)
+			{
+				if (g_relativeErrors[i] == 0) continue;
+
+				// Random rounding so fractional shares still get their samples on average
+				RandomGenerator randomGenerator = SampleRandomGenerator(i, -1, g_frameIndex);
+
+				double share = remainingSampleCount * g_relativeErrors[i] / totalError;
+				int sampleCount = int(share + randomGenerator.NextDouble());
+
+				g_frameSampleCounts[i] = int(Min(sampleCount, ADAPTIVE_MAX_SAMPLES - g_accumulationBuffer[i].sampleCount));
+			}
+		}
+#else
+		std::fill(std::begin(g_frameSampleCounts), std::end(g_frameSampleCounts), SAMPLES_PER_PIXEL);
+#endif
+	}
+
+	// Black for no samples, then blue over green and yellow to red for the most samples of the frame
+	Vec3D SampleCountColor(int sampleCount, int maxSampleCount)
+	{
+		if (sampleCount == 0) return ZERO_VEC3D;
+
+		double heat = log(1.0 + sampleCount) / log(1.0 + maxSampleCount);
 
-			if (DistanceSquared3D(v_start, sphere.coords) < sphere.radius * sphere.radius)
+		Vec3D color;
+		color.x = Clamp(heat * 2 - 0.5, 0.0, 1.0);
+		color.y = Clamp(1.5 - abs(heat * 2 - 1) * 2, 0.0, 1.0);
+		color.z = Clamp(1 - heat * 2, 0.0, 1.0);
+
+		return VecScalarMultiplication3D(color, 255);
+	}
+
+	// Traces one pixel in the middle of every g_previewScale sized block of the tile and fills the block of the traced frame's colors with it, nothing is accumulated
+	int RayTracingPreview(const Tile& tile)
+	{
+		int tileSampleCount = 0;
+
+		for (int blockY = tile.startY; blockY < tile.endY; blockY += g_previewScale)
+		{
+			for (int blockX = tile.startX; blockX < tile.endX; blockX += g_previewScale)
 			{
-				q_surfaceNormal->realPart = -1;
+				int blockEndX = int(Min(blockX + g_previewScale, tile.endX));
+				int blockEndY = int(Min(blockY + g_previewScale, tile.endY));
+
+				Vec3D v_direction = PrimaryRayDirection((blockX + blockEndX) * 0.5, (blockY + blockEndY) * 0.5);
+				NormalizeVec3D(&v_direction);
+
+				Sampler sampler(SampleRandomGenerator(blockY * SCREEN_WIDTH + blockX, 0, g_frameIndex));
+
+				Vec3D pixelColor = RenderPixel(g_renderCamera.coords, v_direction, &sampler);
+
+				for (int screenY = blockY; screenY < blockEndY; screenY++)
+				{
+					for (int screenX = blockX; screenX < blockEndX; screenX++)
+					{
+						SetPlanesColor(&g_frames[g_tracedFrame].planes[0], screenX, screenY, pixelColor);
+					}
+				}
+
+				tileSampleCount++;
 			}
 		}
 
-		if (v_intersectionColor == nullptr)
+		return tileSampleCount;
+	}
+
+	// Direction from the player through a point on the screen, in pixels from the top left corner. Not normalized
+	Vec3D PrimaryRayDirection(double screenX, double screenY)
+	{
+		const double zFar = (SCREEN_WIDTH * 0.5) / tan(g_renderCamera.FOV * 0.5);
+
+		// Relative to the middle of the screen, y pointing up
+		Vec3D v_direction = { screenX - SCREEN_WIDTH * 0.5, SCREEN_HEIGHT * 0.5 - screenY, zFar };
+
+		return QuaternionMultiplication(g_renderCamera.q_orientation, { 0, v_direction }, QuaternionConjugate(g_renderCamera.q_orientation)).vecPart;
+	}
+
+	// Optionally returns the features of the first hit for the denoiser
+	Vec3D RenderPixel(Vec3D v_start, Vec3D v_direction, Sampler* sampler, SurfaceFeatures* features = nullptr)
+	{
+		Vec3D v_intersection = ZERO_VEC3D;
+		Vec3D v_textureColor = ZERO_VEC3D;
+		Quaternion q_surfaceNormal = IDENTITY_QUATERNION;
+		Material material;
+
+		bool intersectionExists = NextIntersection(v_start, v_direction, &v_intersection, &v_textureColor, &q_surfaceNormal, &material);
+
+		if (features)
 		{
-			// Don't return any color
-			return true;
+			*features = { ZERO_VEC3D, ZERO_VEC3D, 0 };
+
+			if (intersectionExists)
+			{
+				*features = { VecScalarMultiplication3D(ConusProduct(v_textureColor, material.diffuseTint), 1.0 / 255), q_surfaceNormal.vecPart, VecLength3D(SubtractVec3D(v_intersection, v_start)) };
+			}
+		}
+
+		if (intersectionExists)
+		{
+#if PATH_TRACING == 1
+			v_textureColor = CalculateLighting_PathTracing(v_textureColor, material, q_surfaceNormal, v_direction, v_intersection, sampler);
+#else
+			sampler->StartBounce(0);
+
+			v_textureColor = CalculateLighting_DistributionTracing(
+				v_textureColor, material, q_surfaceNormal, v_direction, v_intersection, 0, DISTRIBUTION_RAY_BUDGET, sampler
+			);
+#endif
+		}
+
+		return v_textureColor;
+	}
+
+	// Splits a step over the whole image into rows for the threads of the pool and waits until every row is done
+	void RunRows(ThreadPool* threads, const std::function<void(int startRow, int endRow)>& step)
+	{
+#if ASYNC == 1
+		int threadCount = int(threads->threads.size());
+
+		threads->RunJob([&](int threadIndex) { step(SCREEN_HEIGHT * threadIndex / threadCount, SCREEN_HEIGHT * (threadIndex + 1) / threadCount); });
+#else
+		step(0, SCREEN_HEIGHT);
+#endif
+	}
+
+	// Splits a post processing step into chunks of POST_PROCESSING_CHUNK_ROWS rows for g_renderThreads, which take them between their tiles
+	// or right away if no frame is rendering. The calling thread takes chunks as well, and returns once every row is done
+	void RunPostProcessRows(const std::function<void(int startRow, int endRow)>& step)
+	{
+#if ASYNC == 1
+		int chunkCount = (SCREEN_HEIGHT + POST_PROCESSING_CHUNK_ROWS - 1) / POST_PROCESSING_CHUNK_ROWS;
+
+		g_renderThreads.RunShared([&](int chunk) { step(chunk * POST_PROCESSING_CHUNK_ROWS, int(Min((chunk + 1) * POST_PROCESSING_CHUNK_ROWS, SCREEN_HEIGHT))); }, chunkCount);
+#else
+		step(0, SCREEN_HEIGHT);
+#endif
+	}
+
+	// Mean albedo of the first hits, channels with almost no albedo are left out of the demodulation
+	Vec3D DemodulationAlbedo(const AccumulatedFeatures& features, int sampleCount)
+	{
+		Vec3D albedo = VecScalarMultiplication3D({ features.albedoR, features.albedoG, features.albedoB }, 1 / double(Max(sampleCount, 1)));
+
+		return Vec3D{ (albedo.x < 0.01) ? 1 : albedo.x, (albedo.y < 0.01) ? 1 : albedo.y, (albedo.z < 0.01) ? 1 : albedo.z };
+	}
+
+	// Copies everything the post processing needs out of the accumulation into the frame, on the render threads.
+	// After this the render loop is free to trace the next frame. The preview has already written its colors
+	void ResolveFrame(PipelineFrame* frame, bool preview, bool showSampleCounts)
+	{
+		auto start = std::chrono::steady_clock::now();
+
+		frame->preview = preview;
+		frame->showSampleCounts = showSampleCounts;
+
+		if (frame->showSampleCounts)
+		{
+			frame->sampleCounts.assign(std::begin(g_frameSampleCounts), std::end(g_frameSampleCounts));
+		}
+
+		if (!preview)
+		{
+			RunRows(&g_renderThreads, [this, frame](int startRow, int endRow)
+			{
+				for (int y = startRow; y < endRow; y++)
+				{
+					for (int x = 0; x < SCREEN_WIDTH; x++)
+					{
+						const AccumulatedColor& accumulatedColor = g_accumulationBuffer[y * SCREEN_WIDTH + x];
+
+						int sampleCount = accumulatedColor.sampleCount;
+						double inverseSampleCount = 1 / double(Max(sampleCount, 1));
+
+						Vec3D color = VecScalarMultiplication3D({ accumulatedColor.r, accumulatedColor.g, accumulatedColor.b }, inverseSampleCount);
+
+						SetPlanesColor(&frame->planes[0], x, y, color);
+
+#if DENOISER == 1
+						const AccumulatedFeatures& features = g_featureBuffer[y * SCREEN_WIDTH + x];
+
+						Vec3D albedo = DemodulationAlbedo(features, sampleCount);
+
+						// Variance of the mean luminance, from the samples once there are enough of them to estimate it
+						double variance = -1;
+
+						if (sampleCount >= ADAPTIVE_MIN_SAMPLES)
+						{
+							double meanLuminance = Luminance(color);
+							double albedoLuminance = Luminance(albedo);
+
+							variance = Max(accumulatedColor.luminanceSquaredSum * inverseSampleCount - meanLuminance * meanLuminance, 0.0) / (sampleCount - 1);
+							variance /= albedoLuminance * albedoLuminance;
+						}
+
+						Vec3D v_normal = VecScalarMultiplication3D({ features.normalX, features.normalY, features.normalZ }, inverseSampleCount);
+
+						SetDenoiserFeatures(&frame->denoiser, x, y, variance, albedo, v_normal, features.depth * inverseSampleCount);
+#endif
+					}
+				}
+
+				ExtendColorPlanesRows(&frame->planes[0], startRow, endRow);
+			});
+		}
+
+		std::chrono::duration<double> resolveTime = std::chrono::steady_clock::now() - start;
+
+		frame->resolveTime = resolveTime.count();
+	}
+
+	// Turns the frame into g_finishedPixels: the median filter and the denoiser go from one of its planes to the other,
+	// and one fused pass blurs, clamps, converts to sRGB and writes g_outputPixels, which then becomes the finished frame.
+	// Every stage is split into rows with RunPostProcessRows, and the time each one takes is printed
+	void PostProcess(PipelineFrame* frame)
+	{
+		std::ostringstream stageTimes;
+
+		stageTimes << "Post-processing: resolve " << frame->resolveTime * 1000.0 << "ms";
+
+		auto stageStart = std::chrono::steady_clock::now();
+
+		auto EndStage = [&stageStart, &stageTimes](const char* name)
+		{
+			auto now = std::chrono::steady_clock::now();
+			std::chrono::duration<double> stageTime = now - stageStart;
+
+			stageTimes << " " << name << " " << stageTime.count() * 1000.0 << "ms";
+
+			stageStart = now;
+		};
+
+		int current = 0; // index of the planes with the latest colors
+
+		if (frame->preview)
+		{
+			RunPostProcessRows([frame](int startRow, int endRow) { ExtendColorPlanesRows(&frame->planes[0], startRow, endRow); });
+		}
+		else
+		{
+#if MEDIAN_FILTER > 0
+			RunPostProcessRows([frame, current](int startRow, int endRow) { MedianFilterRows(frame->planes[current], &frame->planes[1 - current], MEDIAN_FILTER, startRow, endRow); });
+			current = 1 - current;
+
+			EndStage("median");
+#endif
+
+#if DENOISER == 1
+			Denoise(frame, frame->planes[current], &frame->planes[1 - current]);
+			current = 1 - current;
+
+			EndStage("denoise");
+#endif
+		}
+
+		if (frame->showSampleCounts)
+		{
+			int maxSampleCount = *std::max_element(frame->sampleCounts.begin(), frame->sampleCounts.end());
+
+			for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+			{
+				Vec3D color = SampleCountColor(frame->sampleCounts[i], maxSampleCount);
+
+				g_outputPixels[i] = olc::Pixel(uint8_t(color.x), uint8_t(color.y), uint8_t(color.z));
+			}
+		}
+		else
+		{
+			RunPostProcessRows([frame, current](int startRow, int endRow) { OutputRows(frame->planes[current], g_srgbEncoder, GAUSSIAN_BLUR == 1, g_outputPixels.data(), startRow, endRow); });
+		}
+
+		EndStage("output");
+
+		// Replaces a finished frame OnUserUpdate hasn't shown yet, if there is one
+		{
+			std::lock_guard<std::mutex> lock(g_finishedPixelsMutex);
+
+			std::swap(g_outputPixels, g_finishedPixels);
+			g_newFrameFinished = true;
+		}
+
+		// In one piece, the render loop prints at the same time
+		stageTimes << "\n";
+		std::cout << stageTimes.str() << std::flush;
+	}
+
+	// Filters the colors into denoisedColors with Denoiser.h. ResolveFrame has already filled in the rest of the input
+	void Denoise(PipelineFrame* frame, const ColorPlanes& colors, ColorPlanes* denoisedColors)
+	{
+		RunPostProcessRows([frame, &colors](int startRow, int endRow) { DemodulateRows(&frame->denoiser, colors, startRow, endRow); });
+		RunPostProcessRows([frame](int startRow, int endRow) { PrepareDenoiserRows(&frame->denoiser, startRow, endRow); });
+
+		for (int i = 0; i < DENOISER_ITERATIONS; i++)
+		{
+			RunPostProcessRows([frame, i](int startRow, int endRow) { DenoiserLuminanceScaleRows(&frame->denoiser, i, startRow, endRow); });
+			RunPostProcessRows([frame, i](int startRow, int endRow) { DenoiserIterationRows(&frame->denoiser, i, startRow, endRow); });
+		}
+
+		RunPostProcessRows([frame, denoisedColors](int startRow, int endRow) { RemodulateRows(frame->denoiser, denoisedColors, startRow, endRow); });
+	}
+
+	// Surface interactions: evaluate the texture color and (normal mapped) surface normal of the closest hit.
+	// Only called once the intersection routines have found which primitive is hit
+
+	void GroundSurfaceInteraction(Vec3D v_intersection, Vec3D* v_intersectionColor, Quaternion* q_surfaceNormal)
+	{
+		*q_surfaceNormal = { 1, { 0, 1, 0 } };
+
+		*v_intersectionColor = WHITE_COLOR;
+
+		if (g_ground.texture != nullptr || g_ground.normalMap != nullptr)
+		{
+			double signedTextureWidth = (g_ground.textureCorner2.x - g_ground.textureCorner1.x) * g_ground.textureScalar;
+			double signedTextureHeight = (g_ground.textureCorner2.y - g_ground.textureCorner1.y) * g_ground.textureScalar;
+
+			double t1 = fmod(v_intersection.x, signedTextureWidth) / signedTextureWidth;
+			double t2 = fmod(v_intersection.z, signedTextureHeight) / signedTextureHeight;
+
+			// if the t values are negative, we need to flip them around the center of the texture and make them positive
+			if (t1 < 0) t1 += 1;
+			if (t2 < 0) t2 += 1;
+
+			double textureX = Lerp(g_ground.textureCorner1.x, g_ground.textureCorner2.x, t1);
+			double textureY = Lerp(g_ground.textureCorner1.y, g_ground.textureCorner2.y, t2);
+
+			if (g_ground.texture != nullptr)
+			{
+				olc::Pixel texelColor = g_ground.texture->Sample(textureX, textureY);
+
+				*v_intersectionColor = { double(texelColor.r), double(texelColor.g), double(texelColor.b) };
+			}
+			if (g_ground.normalMap != nullptr)
+			{
+				olc::Pixel normalMapColor = g_ground.normalMap->Sample(textureX, textureY);
+
+				// Converting the color in the normalMap to an actual unit vector
+				q_surfaceNormal->vecPart = ReturnNormalizedVec3D({ double(normalMapColor.r) * 2 - 255.0f, double(normalMapColor.b) * 2 - 255.0f, double(normalMapColor.g) * 2 - 255.0f });
+			}
+		}
+	}
+
+	void SphereSurfaceInteraction(int sphereIndex, Vec3D v_start, Vec3D v_intersection, Vec3D* v_intersectionColor, Quaternion* q_surfaceNormal)
+	{
+		const Sphere& sphere = g_spheres[sphereIndex];
+
+		// Calculating the normal of the sphere (without normalmap)
+		Vec3D v_normal = ReturnNormalizedVec3D(SubtractVec3D(v_intersection, sphere.coords));
+
+		q_surfaceNormal->vecPart = v_normal;
+		q_surfaceNormal->realPart = 1;
+
+		if (DistanceSquared3D(v_start, sphere.coords) < sphere.radius * sphere.radius)
+		{
+			q_surfaceNormal->realPart = -1;
 		}
 
 		*v_intersectionColor = WHITE_COLOR;
@@ -678,12 +1267,11 @@ private:
 				q_surfaceNormal->vecPart = VecMatrixMultiplication3D(v_normalMapNormal, normalMatrix);
 			}
 		}
-		
-		return true;
 	}
 
-	// Ray tracing for triangles
-	bool TriangleIntersection_RT(Triangle triangle, Vec3D v_start, Vec3D v_direction,
+	// Ray tracing for triangles. Recalculates everything from the vertices on every call and samples the textures
+	// of every intersection, kept as a reference for IntersectTriangle + TriangleSurfaceInteraction which the renderer uses
+	bool TriangleIntersection_RT(const Triangle& triangle, Vec3D v_start, Vec3D v_direction,
 		Vec3D* v_intersection = nullptr, Vec3D* v_intersectionColor = nullptr, Quaternion* q_surfaceNormal = nullptr)
 	{
 		Vec3D v_triangleEdge1 = SubtractVec3D(triangle.vertices[1], triangle.vertices[0]);
@@ -829,6 +1417,100 @@ private:
 		return true;
 	}
 
+	// u and v are the barycentric coordinates of the intersection along the triangle edges
+	void TriangleSurfaceInteraction(int triangleIndex, Vec3D v_direction, double u, double v, Vec3D* v_intersectionColor, Quaternion* q_surfaceNormal)
+	{
+		const TriangleShadingData& triangle = g_triangleShading[triangleIndex];
+
+		q_surfaceNormal->vecPart = triangle.normal;
+
+		// The triangle face is inside of the mesh if it faces away from the ray, so the normal must be flipped
+		q_surfaceNormal->realPart = (DotProduct3D(triangle.normal, v_direction) > 0) ? -1 : 1;
+
+		*v_intersectionColor = WHITE_COLOR;
+
+		if (triangle.texture != nullptr || triangle.normalMap != nullptr)
+		{
+			// The barycentric coordinates interpolate the texture coordinates the same way they interpolate the vertices
+			Vec2D textureCoordinates = triangle.textureVertex0;
+
+			AddToVec2D(&textureCoordinates, VecScalarMultiplication2D(triangle.textureEdge1, u));
+			AddToVec2D(&textureCoordinates, VecScalarMultiplication2D(triangle.textureEdge2, v));
+
+			if (triangle.texture != nullptr)
+			{
+				olc::Pixel texelColor = triangle.texture->Sample(textureCoordinates.x, textureCoordinates.y);
+
+				*v_intersectionColor = { double(texelColor.r), double(texelColor.g), double(texelColor.b) };
+			}
+			if (triangle.normalMap != nullptr)
+			{
+				olc::Pixel normalMapColor = triangle.normalMap->Sample(textureCoordinates.x, textureCoordinates.y);
+
+				// Converting the color in the normalMap to an actual unit vector
+				Vec3D v_normalMapNormal = ReturnNormalizedVec3D({ double(normalMapColor.r) * 2 - 255.0f, double(normalMapColor.b) * 2 - 255.0f, double(normalMapColor.g) * 2 - 255.0f });
+
+				// Takes the normal in the normalMap and transforms it into the actual normal of the object
+				Matrix3D normalMatrix =
+				{
+					triangle.tangent,
+					triangle.normal,
+					triangle.bitangent
+				};
+
+				q_surfaceNormal->vecPart = VecMatrixMultiplication3D(v_normalMapNormal, normalMatrix);
+			}
+		}
+	}
+
+	void SurfaceInteraction(const HitRecord& hit, Vec3D v_start, Vec3D v_direction, Vec3D* v_intersection, Vec3D* v_color, Quaternion* q_normal, Material* material)
+	{
+		*v_intersection = AddVec3D(v_start, VecScalarMultiplication3D(v_direction, hit.t));
+
+		if (hit.type == GROUND_PRIMITIVE)
+		{
+			GroundSurfaceInteraction(*v_intersection, v_color, q_normal);
+			*material = g_ground.material;
+		}
+		else if (hit.type == SPHERE_PRIMITIVE)
+		{
+			SphereSurfaceInteraction(hit.index, v_start, *v_intersection, v_color, q_normal);
+			*material = g_spheres[hit.index].material;
+		}
+		else
+		{
+			TriangleSurfaceInteraction(hit.index, v_direction, hit.u, hit.v, v_color, q_normal);
+			*material = g_triangleShading[hit.index].material;
+		}
+	}
+
+	// Intersection tests. They only find the distance to the primitive and skip the intersection point, color and normal,
+	// t is measured in multiples of v_direction (the distance if v_direction is normalized)
+
+	bool GroundDistance_RT(Vec3D v_start, Vec3D v_direction, double* t)
+	{
+		if (v_direction.y >= 0 || v_start.y < g_ground.level)
+		{
+			return false;
+		}
+
+		*t = (g_ground.level - v_start.y) / v_direction.y;
+
+		return true;
+	}
+
+	bool SphereDistance_RT(int sphereIndex, Vec3D v_start, Vec3D v_direction, double* t)
+	{
+		return IntersectSphere(g_sceneGeometry, sphereIndex, v_start, v_direction, t);
+	}
+
+	bool TriangleDistance_RT(int triangleIndex, Vec3D v_start, Vec3D v_direction, double* t)
+	{
+		double u, v;
+
+		return IntersectTriangle(g_sceneGeometry, triangleIndex, v_start, v_direction, t, &u, &v);
+	}
+
 	Vec3D LinePlaneIntersection(Vec3D v_start, Vec3D v_direction, Vec3D v_planeNormal, double f_planeOffset)
 	{
 		double f_deltaOffset = DotProduct3D(v_start, v_planeNormal);
@@ -847,247 +1529,489 @@ private:
 		TRANSMISSIVE
 	};
 
-	Vec3D CalculateLighting_PathTracing(Vec3D v_textureColor, Material material, Quaternion q_surfaceNormal, Vec3D v_incomingDirection, Vec3D v_intersection, Vec3D accumulatedAttenuation, std::mt19937* randomEngine)
+	// First sampler dimension of every decision of a path tracing bounce, so each decision reads the same dimension in every sample
+	// even if an earlier one was skipped. Must stay below SAMPLER_BOUNCE_DIMENSIONS
+	enum PathSampleSlot
 	{
-		Vec3D v_diffuseTint = VecScalarMultiplication3D(ConusProduct(v_textureColor, material.diffuseTint), 1.0 / 255);
+		ROULETTE_SLOT = 0,
+		MICROFACET_SLOT = 1, // 2 dimensions
+		REFLECTION_SLOT = 3,
+		SPECULAR_SLOT = 4,
+		LAMBERTIAN_SLOT = 5, // 2 dimensions
+		LIGHT_SELECTION_SLOT = 7,
+		LIGHT_POINT_SLOT = 8 // 2 dimensions
+	};
 
-		Vec3D v_outgoingLightColor = ConusProduct(v_diffuseTint, material.emittance);
+	// Follows the path from the first intersection until it leaves the scene, reaches PATH_MAX_BOUNCES or is ended by russian roulette.
+	// throughput is how much of the light leaving the current vertex reaches the camera, divided by the probability of the path sampled so far
+	Vec3D CalculateLighting_PathTracing(Vec3D v_textureColor, Material material, Quaternion q_surfaceNormal, Vec3D v_incomingDirection, Vec3D v_intersection, Sampler* sampler)
+	{
+		Vec3D v_outgoingLightColor = ZERO_VEC3D;
+		Vec3D throughput = { 1, 1, 1 };
 
-		// counterintuitive, but the probability goes up when accumulatedAttenuation goes up
-		double survivalProbability = Max(Sigmoid(2 * Max(accumulatedAttenuation.x, Max(accumulatedAttenuation.y, accumulatedAttenuation.z))), 0.1);
+		double emissionWeight = 1.0; // MIS weight of the emitted light, below 1 if the previous bounce also sampled the emitters directly
 
-		// Randomly terminate paths with russian roulette
-		if (uniform_zero_to_one(*randomEngine) > survivalProbability)
+		auto AddLight = [&](Vec3D pathWeight, Vec3D v_lightColor)
 		{
-			return v_outgoingLightColor;
-		}
+			Vec3D contribution = ConusProduct(pathWeight, v_lightColor);
 
-		double refractionIndex1 = REFRACTION_INDEX_AIR;
-		double refractionIndex2 = material.refractionIndex;
-		Vec3D attenuation = { 0, 0, 0 };
+			AddToVec3D(&v_outgoingLightColor, { Min(contribution.x, MAX_COLOR_VALUE), Min(contribution.y, MAX_COLOR_VALUE), Min(contribution.z, MAX_COLOR_VALUE) }); // Introduces bias. To avoid bias MAX_COLOR_VALUE should be very high
+		};
 
-		if (q_surfaceNormal.realPart == -1)
+		for (int bounceCount = 0; ; bounceCount++)
 		{
-			refractionIndex1 = material.refractionIndex;
-			refractionIndex2 = REFRACTION_INDEX_AIR;
-		}
+			sampler->StartBounce(bounceCount);
 
-		ScaleVec3D(&v_incomingDirection, -1);
+			Vec3D v_diffuseTint = VecScalarMultiplication3D(ConusProduct(v_textureColor, material.diffuseTint), 1.0 / 255);
 
-		// Scale the normal to be oriented in the hemisphere the material was hit from
-		ScaleVec3D(&(q_surfaceNormal.vecPart), q_surfaceNormal.realPart);
+			AddLight(throughput, VecScalarMultiplication3D(ConusProduct(v_diffuseTint, material.emittance), emissionWeight));
 
-		Vec3D v_outgoingDirection;
-		ScatteringType scatteringType;
+			if (bounceCount >= PATH_MAX_BOUNCES)
+			{
+				break;
+			}
 
-		Vec3D v_microscopicNormal = MicroscopicNormal(v_incomingDirection, q_surfaceNormal.vecPart, material.roughness, randomEngine); // for specular and transmissive scattering
+			double survivalProbability = 1.0;
 
-		double scatteringTypeProbability; // will be assigned a value later on, used for energy conservation
+			// Randomly terminate paths with russian roulette, the less light a path still carries the more likely it is ended
+			if (bounceCount >= RUSSIAN_ROULETTE_DEPTH)
+			{
+				survivalProbability = Clamp(Max(throughput.x, Max(throughput.y, throughput.z)), 0.1, 1.0);
 
-		bool isMaterialDielectric = (material.type == DIELECTRIC);
-		bool isMaterialMetallic = (material.type == METAL);
+				sampler->UseSlot(ROULETTE_SLOT);
 
-		double reflectionProbability = 1.0; // 1.0 for metals
+				if (sampler->NextDouble() > survivalProbability)
+				{
+					break;
+				}
+			}
 
-		if (!isMaterialMetallic)
-		{
-			double normalisedAttenuation = -exp(-Min(material.attenuation.x, Min(material.attenuation.y, material.attenuation.z))) + 1.0; // between 0 and 1
-			double fresnelDielectric = FresnelDielectric(v_incomingDirection, v_microscopicNormal, refractionIndex1, refractionIndex2) * 0.5;
+			double refractionIndex1 = REFRACTION_INDEX_AIR;
+			double refractionIndex2 = material.refractionIndex;
+			Vec3D attenuation = { 0, 0, 0 };
 
-			reflectionProbability = Max(fresnelDielectric, normalisedAttenuation);
-		}
+			if (q_surfaceNormal.realPart == -1)
+			{
+				refractionIndex1 = material.refractionIndex;
+				refractionIndex2 = REFRACTION_INDEX_AIR;
+			}
 
-		if (uniform_zero_to_one(*randomEngine) <= reflectionProbability)
-		{
-			double specularProbability = 1.0; // 1.0 for non-dielectrics
-			
-			if (isMaterialDielectric)
+			ScaleVec3D(&v_incomingDirection, -1);
+
+			// Scale the normal to be oriented in the hemisphere the material was hit from
+			ScaleVec3D(&(q_surfaceNormal.vecPart), q_surfaceNormal.realPart);
+
+			Vec3D v_outgoingDirection;
+			ScatteringType scatteringType;
+
+			Matrix3D shadingFrame = TangentFrame(q_surfaceNormal.vecPart);
+
+			sampler->UseSlot(MICROFACET_SLOT);
+
+			double microfacetU1 = sampler->NextDouble();
+			double microfacetU2 = sampler->NextDouble();
+
+			// for specular and transmissive scattering
+			Vec3D v_microscopicNormal = VecMatrixMultiplication3D(GGXVisibleNormal(WorldToLocal(v_incomingDirection, shadingFrame), material.roughness, microfacetU1, microfacetU2), shadingFrame);
+
+			double scatteringTypeProbability; // will be assigned a value later on, used for energy conservation
+
+			bool isMaterialDielectric = (material.type == DIELECTRIC);
+			bool isMaterialMetallic = (material.type == METAL);
+
+			double reflectionProbability = 1.0; // 1.0 for metals
+
+			if (!isMaterialMetallic)
 			{
-				specularProbability = material.specularValue / (material.specularValue + Max(material.diffuseTint.x, Max(material.diffuseTint.y, material.diffuseTint.z)));
+				double normalisedAttenuation = -exp(-Min(material.attenuation.x, Min(material.attenuation.y, material.attenuation.z))) + 1.0; // between 0 and 1
+				double fresnelDielectric = FresnelDielectric(v_incomingDirection, v_microscopicNormal, refractionIndex1, refractionIndex2) * 0.5;
+
+				reflectionProbability = Max(fresnelDielectric, normalisedAttenuation);
 			}
 
-			if(uniform_zero_to_one(*randomEngine) <= specularProbability)
+			sampler->UseSlot(REFLECTION_SLOT);
+
+			if (sampler->NextDouble() <= reflectionProbability)
 			{
-				scatteringType = SPECULAR;
+				double specularProbability = 1.0; // 1.0 for non-dielectrics
+			
+				if (isMaterialDielectric)
+				{
+					specularProbability = material.specularValue / (material.specularValue + Max(material.diffuseTint.x, Max(material.diffuseTint.y, material.diffuseTint.z)));
+				}
+
+				sampler->UseSlot(SPECULAR_SLOT);
+
+				if(sampler->NextDouble() <= specularProbability)
+				{
+					scatteringType = SPECULAR;
+
+					v_outgoingDirection = SubtractVec3D(VecScalarMultiplication3D(v_microscopicNormal, 2 * DotProduct3D(v_incomingDirection, v_microscopicNormal)), v_incomingDirection);
+
+					scatteringTypeProbability = specularProbability * reflectionProbability;
+				}
+				else
+				{
+					scatteringType = LAMBERTIAN;
+
+					sampler->UseSlot(LAMBERTIAN_SLOT);
 
-				v_outgoingDirection = SubtractVec3D(VecScalarMultiplication3D(v_microscopicNormal, 2 * DotProduct3D(v_incomingDirection, v_microscopicNormal)), v_incomingDirection);
+					double lambertianU1 = sampler->NextDouble();
+					double lambertianU2 = sampler->NextDouble();
 
-				scatteringTypeProbability = specularProbability * reflectionProbability;
+					v_outgoingDirection = VecMatrixMultiplication3D(CosineHemisphere(lambertianU1, lambertianU2), shadingFrame);
+
+					scatteringTypeProbability = (1 - specularProbability) * reflectionProbability;
+				}
 			}
 			else
 			{
-				scatteringType = LAMBERTIAN;
+				scatteringType = TRANSMISSIVE;
+
+				double n = refractionIndex1 / refractionIndex2;
+
+				double incomingDotBisector = DotProduct3D(v_incomingDirection, v_microscopicNormal);
+
+				double bisectorScalar = n * incomingDotBisector - Sign(DotProduct3D(v_incomingDirection, q_surfaceNormal.vecPart)) * sqrt(Max(1 + n * (incomingDotBisector * incomingDotBisector - 1), 0));
+
+				v_outgoingDirection = SubtractVec3D(VecScalarMultiplication3D(v_microscopicNormal, bisectorScalar), VecScalarMultiplication3D(v_incomingDirection, n));
+
+				scatteringTypeProbability = 1.0 - reflectionProbability;
+			}
+
+			NormalizeVec3D(&v_outgoingDirection);
+
+			// Next event estimation: the Lambertian lobe also samples a point on an emitter directly, and the two samples are combined with MIS.
+			// Only done from outside the object, so the shadow ray doesn't have to account for the attenuation inside it
+			bool sampleEmitters = Options::nextEventEstimation && scatteringType == LAMBERTIAN && q_surfaceNormal.realPart == 1 && !g_lights.emitters.empty();
+
+			if (sampleEmitters)
+			{
+				Vec3D v_directLight = DirectLight_PathTracing(v_intersection, v_incomingDirection, q_surfaceNormal.vecPart, refractionIndex1, refractionIndex2, v_diffuseTint, sampler);
+
+				AddLight(throughput, VecScalarMultiplication3D(v_directLight, 1.0 / (scatteringTypeProbability * survivalProbability)));
+			}
+
+			AddToVec3D(&v_intersection, VecScalarMultiplication3D(v_outgoingDirection, OFFSET_DISTANCE));
+
+			if (DotProduct3D(v_outgoingDirection, q_surfaceNormal.vecPart) * q_surfaceNormal.realPart < 0)
+			{
+				// The ray is going through the object
+				attenuation = material.attenuation;
+			}
+
+			Vec3D weight = ZERO_VEC3D;
 
-				Vec3D v_tangent = ReturnNormalizedVec3D(SubtractVec3D(v_incomingDirection, VecScalarMultiplication3D(q_surfaceNormal.vecPart, DotProduct3D(v_incomingDirection, q_surfaceNormal.vecPart))));
+			if (scatteringType == LAMBERTIAN)
+			{
+				weight = VecScalarMultiplication3D(BRDF_LAMBERTIAN(v_incomingDirection, v_outgoingDirection, q_surfaceNormal.vecPart, refractionIndex1, refractionIndex2, v_diffuseTint), PI / scatteringTypeProbability);
+			}
+			else if (scatteringType == SPECULAR)
+			{
+				weight = VecScalarMultiplication3D(
+					SpecularWeight(v_incomingDirection, v_outgoingDirection, q_surfaceNormal.vecPart, v_microscopicNormal, refractionIndex1, refractionIndex2, material.roughness, material.extinctionCoefficient, material.specularValue, isMaterialMetallic), 1.0 / scatteringTypeProbability
+				);
 
-				Matrix3D transformationMatrix =
+				if (!isMaterialDielectric)
 				{
-					v_tangent,
-					q_surfaceNormal.vecPart,
-					CrossProduct(q_surfaceNormal.vecPart, v_tangent)
-				};
+					weight = ConusProduct(weight, v_diffuseTint);
+				}
+			}
+			else
+			{
+				weight = VecScalarMultiplication3D(TransmissionWeight(v_incomingDirection, v_outgoingDirection, q_surfaceNormal.vecPart, v_microscopicNormal, material.roughness), 1.0 / scatteringTypeProbability);
+			}
+
+			// Add the energy that is lost by randomly terminating paths
+			ScaleVec3D(&weight, 1.0 / survivalProbability);
+
+			HitRecord hit;
+
+			if (!ClosestHit(v_intersection, v_outgoingDirection, &hit))
+			{
+				AddLight(ConusProduct(throughput, weight), AMBIENT_LIGHT);
+				break;
+			}
+
+			Vec3D v_nextIntersection = ZERO_VEC3D;
+			Vec3D v_nextTextureColor = ZERO_VEC3D;
+			Quaternion q_nextNormal = IDENTITY_QUATERNION;
+			Material nextMaterial;
 
-				double randVariable = uniform_zero_to_one(*randomEngine);
-				double theta = uniform_zero_to_one(*randomEngine) * TAU;
+			SurfaceInteraction(hit, v_intersection, v_outgoingDirection, &v_nextIntersection, &v_nextTextureColor, &q_nextNormal, &nextMaterial);
 
-				double r = sqrt(randVariable);
+			emissionWeight = 1.0;
 
-				v_outgoingDirection = VecMatrixMultiplication3D({ r * cos(theta), sqrt(1 - randVariable), r * sin(theta) }, transformationMatrix);
+			if (sampleEmitters && hit.type != GROUND_PRIMITIVE && VecLength3D(nextMaterial.emittance) > 0)
+			{
+				double bsdfPdf = CosineHemispherePdf(DotProduct3D(v_outgoingDirection, q_surfaceNormal.vecPart));
+				double emitterPdf = EmitterPdf({ hit.type, hit.index }, v_intersection, v_nextIntersection);
 
-				scatteringTypeProbability = (1 - specularProbability) * reflectionProbability;
+				emissionWeight = PowerHeuristic(bsdfPdf, emitterPdf);
 			}
+
+			double distance = Distance3D(v_intersection, v_nextIntersection);
+
+			attenuation = { exp(-attenuation.x * distance), exp(-attenuation.y * distance), exp(-attenuation.z * distance) };
+
+			throughput = ConusProduct(throughput, ConusProduct(weight, attenuation));
+
+			// The next intersection becomes the current vertex
+			v_textureColor = v_nextTextureColor;
+			material = nextMaterial;
+			q_surfaceNormal = q_nextNormal;
+			v_incomingDirection = v_outgoingDirection;
+			v_intersection = v_nextIntersection;
 		}
-		else
-		{
-			scatteringType = TRANSMISSIVE;
 
-			double n = refractionIndex1 / refractionIndex2;
+		return v_outgoingLightColor;
+	}
+
+	// Light sampling half of the next event estimation for the Lambertian lobe: picks a point on an emitter,
+	// traces a shadow ray to it and returns the emitted light times the BRDF, cosine and MIS weight over the pdf
+	Vec3D DirectLight_PathTracing(Vec3D v_point, Vec3D v_outgoingDirection, Vec3D v_normal, double refractionIndex1, double refractionIndex2, Vec3D v_diffuseTint, Sampler* sampler)
+	{
+		sampler->UseSlot(LIGHT_SELECTION_SLOT);
+		PrimitiveReference emitter = g_lights.emitters[SampleLight(g_lights, sampler)];
 
-			double incomingDotBisector = DotProduct3D(v_incomingDirection, v_microscopicNormal);
+		sampler->UseSlot(LIGHT_POINT_SLOT);
+		Vec3D v_emitterPoint = SampleEmitterPoint(emitter, v_point, sampler);
 
-			double bisectorScalar = n * incomingDotBisector - Sign(DotProduct3D(v_incomingDirection, q_surfaceNormal.vecPart)) * sqrt(Max(1 + n * (incomingDotBisector * incomingDotBisector - 1), 0));
+		Vec3D v_lightDirection = SubtractVec3D(v_emitterPoint, v_point);
+		double distance = VecLength3D(v_lightDirection);
+		ScaleVec3D(&v_lightDirection, 1 / distance);
 
-			v_outgoingDirection = SubtractVec3D(VecScalarMultiplication3D(v_microscopicNormal, bisectorScalar), VecScalarMultiplication3D(v_incomingDirection, n));
+		double cosTheta = DotProduct3D(v_lightDirection, v_normal);
 
-			scatteringTypeProbability = 1.0 - reflectionProbability;
-		}
+		if (cosTheta <= 0) return ZERO_VEC3D;
 
-		NormalizeVec3D(&v_outgoingDirection);
+		// The shadow ray has to reach the sampled point itself, points on the far side of a sphere are blocked by its near side
+		Vec3D v_start = AddVec3D(v_point, VecScalarMultiplication3D(v_lightDirection, OFFSET_DISTANCE));
 
-		AddToVec3D(&v_intersection, VecScalarMultiplication3D(v_outgoingDirection, OFFSET_DISTANCE));
+		HitRecord hit;
 
-		if (DotProduct3D(v_outgoingDirection, q_surfaceNormal.vecPart) * q_surfaceNormal.realPart < 0)
+		if (!ClosestHit(v_start, v_lightDirection, &hit) || hit.type != emitter.type || hit.index != emitter.index || hit.t < (distance - OFFSET_DISTANCE) * (1 - 1e-6))
 		{
-			// The ray is going through the object
-			attenuation = material.attenuation;
+			return ZERO_VEC3D;
 		}
 
-		Vec3D v_nextIntersection = ZERO_VEC3D;
-		Vec3D v_nextTextureColor = ZERO_VEC3D;
-		Quaternion q_nextNormal = IDENTITY_QUATERNION;
-		Material nextMaterial;
+		Vec3D v_lightPoint, v_lightTextureColor;
+		Quaternion q_lightNormal;
+		Material lightMaterial;
 
-		Vec3D weight = ZERO_VEC3D;
+		SurfaceInteraction(hit, v_start, v_lightDirection, &v_lightPoint, &v_lightTextureColor, &q_lightNormal, &lightMaterial);
 
-		if (scatteringType == LAMBERTIAN)
-		{
-			weight = VecScalarMultiplication3D(BRDF_LAMBERTIAN(v_incomingDirection, v_outgoingDirection, q_surfaceNormal.vecPart, refractionIndex1, refractionIndex2, v_diffuseTint), PI / scatteringTypeProbability);
-		}
-		else if (scatteringType == SPECULAR)
+		Vec3D v_emittedLight = ConusProduct(VecScalarMultiplication3D(ConusProduct(v_lightTextureColor, lightMaterial.diffuseTint), 1.0 / 255), lightMaterial.emittance);
+
+		double emitterPdf = EmitterPdf(emitter, v_point, v_emitterPoint);
+		double bsdfPdf = CosineHemispherePdf(cosTheta);
+
+		if (emitterPdf == 0) return ZERO_VEC3D;
+
+		Vec3D brdf = BRDF_LAMBERTIAN(v_outgoingDirection, v_lightDirection, v_normal, refractionIndex1, refractionIndex2, v_diffuseTint);
+
+		return VecScalarMultiplication3D(ConusProduct(v_emittedLight, brdf), cosTheta * PowerHeuristic(emitterPdf, bsdfPdf) / emitterPdf);
+	}
+
+	// Point on the emitter as seen from v_point. Spheres are sampled uniformly in the cone they fill and triangles uniformly in their
+	// solid angle, so every sample lands on the visible side and carries the same weight. Falls back to uniform points on the surface
+	// from inside a sphere and for triangles with too small or too large solid angles
+	Vec3D SampleEmitterPoint(PrimitiveReference emitter, Vec3D v_point, Sampler* sampler)
+	{
+		double u1 = sampler->NextDouble();
+		double u2 = sampler->NextDouble();
+
+		if (emitter.type == SPHERE_PRIMITIVE)
 		{
-			weight = VecScalarMultiplication3D(
-				BRDF_COOKTORRANCE(v_incomingDirection, v_outgoingDirection, q_surfaceNormal.vecPart, v_microscopicNormal, refractionIndex1, refractionIndex2, material.roughness, material.extinctionCoefficient, material.specularValue, isMaterialMetallic), 1.0 / scatteringTypeProbability
-			);
+			const Sphere& sphere = g_spheres[emitter.index];
+
+			Vec3D v_toCenter = SubtractVec3D(sphere.coords, v_point);
+			double distanceSquared = DotProduct3D(v_toCenter, v_toCenter);
 
-			if (!isMaterialDielectric)
+			if (distanceSquared <= sphere.radius * sphere.radius)
 			{
-				weight = ConusProduct(weight, v_diffuseTint);
+				return AddVec3D(sphere.coords, VecScalarMultiplication3D(UniformSphere(u1, u2), sphere.radius));
 			}
-		}
-		else
-		{
-			weight = VecScalarMultiplication3D(BTDF(v_incomingDirection, v_outgoingDirection, q_surfaceNormal.vecPart, v_microscopicNormal, refractionIndex1, refractionIndex2, material.roughness), 1.0 / scatteringTypeProbability);
-		}
 
-		Vec3D v_incomingLightColor = AMBIENT_LIGHT;
+			double distance = sqrt(distanceSquared);
+			Vec3D v_localDirection = UniformCone(u1, u2, SphereConeOneMinusCosThetaMax(distanceSquared, sphere.radius));
+			Vec3D v_direction = VecMatrixMultiplication3D(v_localDirection, TangentFrame(VecScalarMultiplication3D(v_toCenter, 1 / distance)));
 
-		bool intersectionExists = NextIntersection(v_intersection, v_outgoingDirection, &v_nextIntersection, &v_nextTextureColor, &q_nextNormal, &nextMaterial);
+			// Closest intersection with the sphere, directions at the edge of the cone only graze it
+			double halfChord = sqrt(Max(sphere.radius * sphere.radius - distanceSquared * (1 - v_localDirection.y * v_localDirection.y), 0));
 
-		double distance = Distance3D(v_intersection, v_nextIntersection);
+			return AddVec3D(v_point, VecScalarMultiplication3D(v_direction, distance * v_localDirection.y - halfChord));
+		}
 
-		attenuation = { exp(-attenuation.x * distance), exp(-attenuation.y * distance), exp(-attenuation.z * distance) };
+		Vec3D v_vertex0 = g_sceneGeometry.triangleVertices0[emitter.index];
+		Vec3D v_edge1 = g_sceneGeometry.triangleEdges1[emitter.index];
+		Vec3D v_edge2 = g_sceneGeometry.triangleEdges2[emitter.index];
 
-		weight = ConusProduct(weight, attenuation);
+		Vec3D a = SubtractVec3D(v_vertex0, v_point);
+		Vec3D b = AddVec3D(a, v_edge1);
+		Vec3D c = AddVec3D(a, v_edge2);
 
-		if (intersectionExists)
+		Vec3D v_direction;
+
+		if (UseSphericalTriangleSampling(emitter.index, v_point, nullptr) && SphericalTriangle(a, b, c, u1, u2, &v_direction))
 		{
-			v_incomingLightColor = CalculateLighting_PathTracing(
-				v_nextTextureColor, nextMaterial, q_nextNormal, v_outgoingDirection, v_nextIntersection, accumulatedAttenuation, randomEngine
-			);
+			Vec3D v_normal = g_triangleShading[emitter.index].normal;
+
+			return AddVec3D(v_point, VecScalarMultiplication3D(v_direction, DotProduct3D(a, v_normal) / DotProduct3D(v_direction, v_normal)));
 		}
 
-		v_incomingLightColor = { Min(v_incomingLightColor.x, MAX_COLOR_VALUE), Min(v_incomingLightColor.y, MAX_COLOR_VALUE), Min(v_incomingLightColor.z, MAX_COLOR_VALUE) }; // Introduces bias. To avoid bias MAX_COLOR_VALUE should be very high
+		double squareRoot = sqrt(u1);
+
+		return AddVec3D(v_vertex0, AddVec3D(VecScalarMultiplication3D(v_edge1, squareRoot * (1 - u2)), VecScalarMultiplication3D(v_edge2, squareRoot * u2)));
+	}
+
+	// Also returns the solid angle of the triangle if solidAngle isn't null
+	bool UseSphericalTriangleSampling(int triangleIndex, Vec3D v_point, double* solidAngle)
+	{
+		Vec3D a = SubtractVec3D(g_sceneGeometry.triangleVertices0[triangleIndex], v_point);
 
-		// Add the energy that is lost by randomly terminating paths
-		ScaleVec3D(&v_incomingLightColor, 1.0 / survivalProbability);
+		double triangleSolidAngle = SphericalTriangleArea(a, AddVec3D(a, g_sceneGeometry.triangleEdges1[triangleIndex]), AddVec3D(a, g_sceneGeometry.triangleEdges2[triangleIndex]));
 
-		AddToVec3D(&v_outgoingLightColor, ConusProduct(v_incomingLightColor, weight));
+		if (solidAngle) *solidAngle = triangleSolidAngle;
 
-		return v_outgoingLightColor;
+		return triangleSolidAngle >= MIN_SPHERICAL_TRIANGLE_AREA && triangleSolidAngle <= MAX_SPHERICAL_TRIANGLE_AREA;
 	}
 
-	bool NextIntersection(Vec3D v_start, Vec3D v_direction, Vec3D* v_intersection, Vec3D* v_color, Quaternion* q_normal, Material* material)
+	// Solid angle pdf of SampleEmitterPoint picking v_emitterPoint as seen from v_point
+	double EmitterPointPdf(PrimitiveReference emitter, Vec3D v_point, Vec3D v_emitterPoint)
 	{
-		// Check all spheres
-		for (int i = 0; i < g_spheres.size(); i++)
+		Vec3D v_emitterNormal;
+		double area;
+
+		if (emitter.type == SPHERE_PRIMITIVE)
 		{
-			bool sphereIntersect = SphereIntersection_RT(g_spheres[i], v_start, v_direction, v_intersection, v_color, q_normal);
+			const Sphere& sphere = g_spheres[emitter.index];
 
-			if (sphereIntersect && !IsRayBlocked(v_start, v_direction, *v_intersection))
+			double distanceSquared = DistanceSquared3D(v_point, sphere.coords);
+
+			if (distanceSquared > sphere.radius * sphere.radius)
 			{
-				*material = g_spheres[i].material;
-				return true;
+				return UniformConePdf(SphereConeOneMinusCosThetaMax(distanceSquared, sphere.radius));
 			}
-		}
 
-		// Check all triangles
-		for (int i = 0; i < g_triangles.size(); i++)
+			v_emitterNormal = ReturnNormalizedVec3D(SubtractVec3D(v_emitterPoint, sphere.coords));
+			area = 2 * TAU * sphere.radius * sphere.radius;
+		}
+		else
 		{
-			bool triangleIntersect = TriangleIntersection_RT(g_triangles[i], v_start, v_direction, v_intersection, v_color, q_normal);
+			double solidAngle;
 
-			if (triangleIntersect && !IsRayBlocked(v_start, v_direction, *v_intersection))
+			if (UseSphericalTriangleSampling(emitter.index, v_point, &solidAngle))
 			{
-				*material = g_triangles[i].material;
-				return true;
+				return 1 / solidAngle;
 			}
+
+			v_emitterNormal = g_triangleShading[emitter.index].normal;
+			area = 0.5 * VecLength3D(CrossProduct(g_sceneGeometry.triangleEdges1[emitter.index], g_sceneGeometry.triangleEdges2[emitter.index]));
 		}
 
-		// Check ground
-		bool groundIntersect = GroundIntersection_RT(v_start, v_direction, v_intersection, v_color, q_normal);
+		Vec3D v_toEmitter = SubtractVec3D(v_emitterPoint, v_point);
+		double distanceSquared = DotProduct3D(v_toEmitter, v_toEmitter);
+		double cosEmitter = Abs(DotProduct3D(v_emitterNormal, v_toEmitter)) / sqrt(distanceSquared);
 
-		if (groundIntersect)
-		{
-			*material = g_ground.material;
-			return true;
-		}
+		if (cosEmitter == 0) return 0;
+
+		return distanceSquared / (cosEmitter * area);
+	}
+
+	// Solid angle pdf of SampleLight and SampleEmitterPoint picking v_emitterPoint as seen from v_point
+	double EmitterPdf(PrimitiveReference emitter, Vec3D v_point, Vec3D v_emitterPoint)
+	{
+		double selectionProbability = LightProbability(g_lights, emitter);
+
+		if (selectionProbability == 0) return 0;
+
+		return selectionProbability * EmitterPointPdf(emitter, v_point, v_emitterPoint);
+	}
+
+	double PowerHeuristic(double pdf, double otherPdf)
+	{
+		return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
 	}
 
-	bool IsRayBlocked(Vec3D v_start, Vec3D v_direction, Vec3D v_intersection)
+	// Finds the closest intersection along the ray. Every primitive is tested once while the closest
+	// distance found so far shrinks, no textures or normals are evaluated here
+	bool ClosestHit(Vec3D v_start, Vec3D v_direction, HitRecord* hit)
 	{
-		Vec3D v_otherIntersection = ZERO_VEC3D;
+		hit->t = INFINITY; // also culls BVH nodes further away than the closest hit so far
 
-		for (int j = 0; j < g_spheres.size(); j++)
+		bool intersectionExists = false;
+
+		// Check all spheres and triangles along the ray, nearest BVH nodes first
+		TraverseBVH(g_bvh, v_start, v_direction, &hit->t, [&](PrimitiveReference primitive)
 		{
-			bool otherIntersectionExists = SphereIntersection_RT(g_spheres[j], v_start, v_direction, &v_otherIntersection);
+			double t, u = 0, v = 0;
+
+			bool primitiveIntersectionExists = (primitive.type == SPHERE_PRIMITIVE) ?
+				SphereDistance_RT(primitive.index, v_start, v_direction, &t) :
+				IntersectTriangle(g_sceneGeometry, primitive.index, v_start, v_direction, &t, &u, &v);
 
-			// If there exists a closer intersection to the ray start vector it means the ray is blocked
-			if (otherIntersectionExists && DistanceSquared3D(v_start, v_otherIntersection) < DistanceSquared3D(v_start, v_intersection))
+			if (primitiveIntersectionExists && t < hit->t)
 			{
-				return true;
+				*hit = { primitive.type, primitive.index, t, u, v };
+				intersectionExists = true;
 			}
-		}
 
-		for (int j = 0; j < g_triangles.size(); j++)
+			return false; // keep going, a closer primitive might still be found
+		});
+
+		// Check ground, which isn't part of the BVH since it's an infinite plane
+		double tGround;
+
+		if (GroundDistance_RT(v_start, v_direction, &tGround) && tGround < hit->t)
 		{
-			bool otherIntersectionExists = TriangleIntersection_RT(g_triangles[j], v_start, v_direction, &v_otherIntersection);
+			*hit = { GROUND_PRIMITIVE, 0, tGround, 0, 0 };
+			intersectionExists = true;
+		}
 
-			// If there exists a closer intersection to the ray start vector it means the ray is blocked
-			if (otherIntersectionExists && DistanceSquared3D(v_start, v_otherIntersection) < DistanceSquared3D(v_start, v_intersection))
-			{
-				return true;
-			}
+		return intersectionExists;
+	}
+
+	// Closest hit followed by the surface interaction of that hit
+	bool NextIntersection(Vec3D v_start, Vec3D v_direction, Vec3D* v_intersection, Vec3D* v_color, Quaternion* q_normal, Material* material)
+	{
+		HitRecord hit;
+
+		if (!ClosestHit(v_start, v_direction, &hit))
+		{
+			return false;
 		}
 
-		bool otherIntersectionExists = GroundIntersection_RT(v_start, v_direction, &v_otherIntersection);
+		SurfaceInteraction(hit, v_start, v_direction, v_intersection, v_color, q_normal, material);
+
+		return true;
+	}
+
+	// Any-hit query for shadow rays: is there anything between v_start and v_start + v_direction * maxDistance?
+	// Stops at the first blocker found
+	bool IsOccluded(Vec3D v_start, Vec3D v_direction, double maxDistance)
+	{
+		double t;
 
-		// If there exists a closer intersection to the ray start vector it means the ray is blocked
-		if (otherIntersectionExists && DistanceSquared3D(v_start, v_otherIntersection) < DistanceSquared3D(v_start, v_intersection))
+		if (GroundDistance_RT(v_start, v_direction, &t) && t < maxDistance)
 		{
 			return true;
 		}
 
-		// The ray is not blocked
-		return false;
+		bool isOccluded = false;
+
+		TraverseBVH(g_bvh, v_start, v_direction, &maxDistance, [&](PrimitiveReference primitive)
+		{
+			bool intersectionExists = (primitive.type == SPHERE_PRIMITIVE) ?
+				SphereDistance_RT(primitive.index, v_start, v_direction, &t) :
+				TriangleDistance_RT(primitive.index, v_start, v_direction, &t);
+
+			isOccluded = intersectionExists && t < maxDistance;
+
+			return isOccluded; // stop as soon as anything blocks the ray
+		});
+
+		return isOccluded;
 	}
 
 	// Cook-Torrance (cock tolerance) BRDF with GGX distribution function and GGX geometry function
@@ -1174,23 +2098,51 @@ private:
 		return Chi(DotProduct3D(vec, v_microscopicNormal) / DotProduct3D(vec, v_normal)) * 2 / (1 + sqrt(1 + 1 / a2));
 	}
 
-	Vec3D BTDF(Vec3D v_incomingDirection, Vec3D v_outgoingDirection, Vec3D v_normal, Vec3D v_microscopicNormal, double refractionIndex1, double refractionIndex2, double roughness)
+	// Masking-shadowing left over in the weight of a microscopic normal sampled with GGXVisibleNormal: G2 / G1 of the incoming direction
+	double VisibleNormalMasking(Vec3D v_incomingDirection, Vec3D v_outgoingDirection, Vec3D v_normal, Vec3D v_microscopicNormal, double roughness)
 	{
-		double btdf = Abs(DotProduct3D(v_incomingDirection, v_microscopicNormal)) * GeometryBidirectional(v_incomingDirection, v_outgoingDirection, v_normal, v_microscopicNormal, roughness) /
-			(Abs(DotProduct3D(v_incomingDirection, v_normal)) * Abs(DotProduct3D(v_microscopicNormal, v_normal)));
+		double incomingMasking = GeometryMonodirectional(v_incomingDirection, v_normal, v_microscopicNormal, roughness);
+
+		if (incomingMasking == 0) return 0;
+
+		return GeometryBidirectional(v_incomingDirection, v_outgoingDirection, v_normal, v_microscopicNormal, roughness) / incomingMasking;
+	}
+
+	// BRDF_COOKTORRANCE times the cosine over the pdf of a reflection about a normal from GGXVisibleNormal
+	Vec3D SpecularWeight(Vec3D v_incomingDirection, Vec3D v_outgoingDirection, Vec3D v_normal, Vec3D v_microscopicNormal, double refractionIndex1, double refractionIndex2, double roughness, double extinctionCoefficient, double specularValue, bool isMaterialMetallic)
+	{
+		double fresnelFactor;
+
+		if (isMaterialMetallic)
+		{
+			fresnelFactor = FresnelConductor(v_incomingDirection, v_microscopicNormal, refractionIndex1, refractionIndex2, extinctionCoefficient);
+		}
+		else
+		{
+			fresnelFactor = FresnelDielectric(v_incomingDirection, v_microscopicNormal, refractionIndex1, refractionIndex2);
+		}
+
+		double specularTerm = specularValue * fresnelFactor * VisibleNormalMasking(v_incomingDirection, v_outgoingDirection, v_normal, v_microscopicNormal, roughness);
 
-		return { btdf, btdf, btdf };
+		return { specularTerm, specularTerm, specularTerm };
 	}
 
+	// BTDF times the cosine over the pdf of a refraction through a normal from GGXVisibleNormal. The Fresnel term is left to the choice between reflection and transmission
+	Vec3D TransmissionWeight(Vec3D v_incomingDirection, Vec3D v_outgoingDirection, Vec3D v_normal, Vec3D v_microscopicNormal, double roughness)
+	{
+		double transmissionTerm = VisibleNormalMasking(v_incomingDirection, v_outgoingDirection, v_normal, v_microscopicNormal, roughness);
+
+		return { transmissionTerm, transmissionTerm, transmissionTerm };
+	}
 	// computing the bisector vector (microscopic normal) used for importance sampling
-	Vec3D MicroscopicNormal(Vec3D v_incomingDirection, Vec3D v_normal, double roughness, std::mt19937* randomEngine)
+	Vec3D MicroscopicNormal(Vec3D v_incomingDirection, Vec3D v_normal, double roughness, Sampler* sampler)
 	{
-		double randVariable = uniform_zero_to_one(*randomEngine);
+		double randVariable = sampler->NextDouble();
 
 		double cosTheta = sqrt((1 - randVariable) / (randVariable * (roughness * roughness - 1) + 1));
 		double sinTheta = sqrt(1 - cosTheta * cosTheta);
 
-		double randAngle = uniform_zero_to_one(*randomEngine) * TAU;
+		double randAngle = sampler->NextDouble() * TAU;
 
 		Vec3D v_bisectorVector = { sinTheta * cos(randAngle), cosTheta, sinTheta * sin(randAngle) };
 
@@ -1206,7 +2158,94 @@ private:
 		return VecMatrixMultiplication3D(v_bisectorVector, transformationMatrix);
 	}
 
-	Vec3D CalculateLighting_DistributionTracing(Vec3D v_textureColor, Material material, Quaternion q_surfaceNormal, Vec3D v_incomingDirection, Vec3D v_intersection, int bounceCount, std::mt19937* randomEngine)
+	// Samples per hit at the bounce from DISTRIBUTION_SAMPLE_SCHEDULE
+	int DistributionSampleCount(int bounceCount)
+	{
+		const int sampleSchedule[] = DISTRIBUTION_SAMPLE_SCHEDULE;
+		const int scheduleLength = sizeof(sampleSchedule) / sizeof(sampleSchedule[0]);
+
+		return sampleSchedule[(bounceCount < scheduleLength) ? bounceCount : scheduleLength - 1];
+	}
+
+	// Rays the schedule traces below a hit at the bounce: its shadow rays plus every reflection ray and what that traces in turn
+	double DistributionScheduledRays(int bounceCount)
+	{
+		double rays = DistributionSampleCount(g_maxBounces);
+
+		for (int i = g_maxBounces - 1; i >= bounceCount; i--)
+		{
+			rays = DistributionSampleCount(i) * (2 + rays);
+		}
+
+		return (bounceCount > g_maxBounces) ? 0 : rays;
+	}
+
+	// Sampler dimensions of a distribution tracing hit, counted from its first dimension. Every light and reflection sample has slots of its own,
+	// so each decision reads the same dimension in every sample even if the budget skipped an earlier one. Sample sizes are multiples of 4 to keep
+	// the 2D decisions inside one group of Sobol dimensions
+	enum DistributionSampleSlot
+	{
+		LIGHT_COUNT_SLOT = 0,
+		REFLECTION_COUNT_SLOT = 1,
+		DISTRIBUTION_SAMPLES_SLOT = 4, // the light samples, then the reflection samples
+		LIGHT_SAMPLE_DIMENSIONS = 4, // the light, then 2 for the point on it
+		REFLECTION_SAMPLE_DIMENSIONS = 8 // 2 for the microscopic normal, 3 for the roughness offset from the 4th on
+	};
+
+	// Sampler dimensions a hit at the bounce uses itself
+	int DistributionHitDimensions(int bounceCount)
+	{
+		return DISTRIBUTION_SAMPLES_SLOT + DistributionSampleCount(bounceCount) * (LIGHT_SAMPLE_DIMENSIONS + REFLECTION_SAMPLE_DIMENSIONS);
+	}
+
+	// Sampler dimensions of a hit at the bounce and of the hits below it. The hit comes first, then the range of every reflection's hit in turn,
+	// so the branches of one sample don't share dimensions
+	int DistributionTreeDimensions(int bounceCount)
+	{
+		int dimensions = DistributionHitDimensions(g_maxBounces);
+
+		for (int i = g_maxBounces - 1; i >= bounceCount; i--)
+		{
+			dimensions = DistributionHitDimensions(i) + DistributionSampleCount(i) * dimensions;
+		}
+
+		return dimensions;
+	}
+
+	// How many of the scheduled samples the budget pays for, rounded up or down at random so the expected cost is the budget.
+	// Averaging fewer samples is still unbiased as long as at least one is taken. If the budget doesn't pay for a single sample,
+	// one is taken with the affordable fraction as its probability, and *weight is set to make up for the times none is
+	int BudgetedSampleCount(int scheduledCount, double affordableCount, Sampler* sampler, double* weight)
+	{
+		*weight = 1;
+
+		if (affordableCount >= scheduledCount)
+		{
+			return scheduledCount;
+		}
+
+		if (affordableCount >= 1)
+		{
+			int sampleCount = int(affordableCount);
+
+			if (sampler->NextDouble() < affordableCount - sampleCount) sampleCount++;
+
+			return sampleCount;
+		}
+
+		if (affordableCount > 0 && sampler->NextDouble() < affordableCount)
+		{
+			*weight = 1 / affordableCount;
+
+			return 1;
+		}
+
+		return 0;
+	}
+
+	// rayBudget is how many rays may be traced below this hit. It's split between the shadow rays and the reflections in proportion to what the schedule asks for,
+	// and what a reflection doesn't spend on its own ray is passed on to its hit. A budget below the schedule only costs variance, the expected color stays the same
+	Vec3D CalculateLighting_DistributionTracing(Vec3D v_textureColor, Material material, Quaternion q_surfaceNormal, Vec3D v_incomingDirection, Vec3D v_intersection, int bounceCount, double rayBudget, Sampler* sampler)
 	{
 		Vec3D albedoColor = VecScalarMultiplication3D(ConusProduct(v_textureColor, material.diffuseTint), 1.0 / 255);
 
@@ -1214,68 +2253,78 @@ private:
 		AddToVec3D(&v_intersection, VecScalarMultiplication3D(q_surfaceNormal.vecPart, OFFSET_DISTANCE));
 
 
+		int scheduledSamples = DistributionSampleCount(bounceCount);
+		double scheduledRays = DistributionScheduledRays(bounceCount);
+		double budgetShare = Min(rayBudget / scheduledRays, 1); // fraction of the scheduled rays the budget pays for
+
+		int hitDimension = sampler->bounceDimension;
+		int reflectionSlot = DISTRIBUTION_SAMPLES_SLOT + scheduledSamples * LIGHT_SAMPLE_DIMENSIONS;
+
+		sampler->UseSlot(LIGHT_COUNT_SLOT);
+
+		double lightWeight;
+		int lightSamples = g_lights.emitters.empty() ? 0 : BudgetedSampleCount(scheduledSamples, scheduledSamples * budgetShare, sampler, &lightWeight);
+
 		Vec3D directLight = ZERO_VEC3D; // all the direct light
 
-		// calculating direct light
-		for (int i = 0; i < g_spheres.size(); ++i)
+		// calculating direct light, every sample picks one light source from g_lights in proportion to its power
+		for (int j = 0; j < lightSamples; ++j)
 		{
-			Sphere lightSource = g_spheres[i];
+			sampler->UseSlot(DISTRIBUTION_SAMPLES_SLOT + j * LIGHT_SAMPLE_DIMENSIONS);
 
-			if (VecLength3D(lightSource.material.emittance) == 0)
-			{
-				continue; // no emittance
-			}
+			double selectionProbability;
+			PrimitiveReference lightSource = g_lights.emitters[SampleLight(g_lights, sampler, &selectionProbability)];
 
-			Vec3D averageDirectLight = ZERO_VEC3D; // average for a given lightsource
+			sampler->UseSlot(DISTRIBUTION_SAMPLES_SLOT + j * LIGHT_SAMPLE_DIMENSIONS + 1);
 
-			for (int j = 0; j < SAMPLES_PER_BOUNCE; ++j)
-			{
-				Vec3D directionToLight = SubtractVec3D(lightSource.coords, v_intersection);
-				NormalizeVec3D(&directionToLight);
+			Vec3D lightSample = EmitterLight_DistributionTracing(lightSource, v_intersection, sampler);
 
-				AddToVec3D(&directionToLight, VecScalarMultiplication3D(RandomVec_InUnitSphere(randomEngine), lightSource.radius));
-				NormalizeVec3D(&directionToLight); // renormalize
+			AddToVec3D(&directLight, VecScalarMultiplication3D(lightSample, 1.0 / selectionProbability));
+		}
 
-				double distanceToCenter = Distance3D(v_intersection, lightSource.coords);
+		if (lightSamples > 0) ScaleVec3D(&directLight, lightWeight / lightSamples);
 
-				Vec3D v_lightIntersection;
-				bool intersectionExists = SphereIntersection_RT(lightSource, v_intersection, directionToLight, &v_lightIntersection);
-				bool rayIsBlocked = IsRayBlocked(v_intersection, directionToLight, v_lightIntersection);
+		Vec3D v_outgoingLightColor = AddVec3D(ConusProduct(directLight, albedoColor), ConusProduct(material.emittance, albedoColor)); // add direct light and emitted light
 
-				double reciprocalPDF = 1.0 - (distanceToCenter / sqrt(distanceToCenter * distanceToCenter + lightSource.radius * lightSource.radius)); // reciprocal of the light source sampling PDF
-				// calculated as 1 - cos(maximum angle between v_intersection and a point on the sphere)
 
-				if (intersectionExists && !rayIsBlocked)
-				{
-					AddToVec3D(&averageDirectLight, VecScalarMultiplication3D(ConusProduct(lightSource.material.emittance, lightSource.material.diffuseTint), reciprocalPDF)); // doesn't work if the light source has a texture
-				}
-			}
+		if (bounceCount >= g_maxBounces)
+		{
+			return v_outgoingLightColor; // return if the ray has bounced too many times
+		}
 
-			ScaleVec3D(&averageDirectLight, 1.0 / SAMPLES_PER_BOUNCE);
 
-			AddToVec3D(&directLight, averageDirectLight);
-		}
+		double reflectionRays = 1 + DistributionScheduledRays(bounceCount + 1); // the reflection ray and everything below its hit
+		double reflectionBudget = (scheduledRays - scheduledSamples) * budgetShare;
 
-		Vec3D v_outgoingLightColor = AddVec3D(ConusProduct(directLight, albedoColor), ConusProduct(material.emittance, albedoColor)); // add direct light and emitted light
+		sampler->UseSlot(REFLECTION_COUNT_SLOT);
 
+		double reflectionWeight;
+		int reflectionSamples = BudgetedSampleCount(scheduledSamples, reflectionBudget / reflectionRays, sampler, &reflectionWeight);
 
-		if (bounceCount >= MAX_BOUNCES)
+		if (reflectionSamples == 0)
 		{
-			return v_outgoingLightColor; // return if the ray has bounced too many times
+			return v_outgoingLightColor;
 		}
 
+		// A reflection taken with a probability below 1 gets the budget of all the times it isn't, so its hit still follows the schedule
+		// and the expected cost stays reflectionBudget. Without the weight the hits below a small budget would never sample a light
+		double nextRayBudget = reflectionBudget * reflectionWeight / reflectionSamples - 1;
 
 		Vec3D averageReflectedLight = ZERO_VEC3D;
 
 		ScaleVec3D(&v_incomingDirection, -1); // should be pointing away from the object due to convention
 
 		// Calculating reflections
-		for (int i = 0; i < SAMPLES_PER_BOUNCE; ++i)
+		for (int i = 0; i < reflectionSamples; ++i)
 		{
-			Vec3D v_microscopicNormal = MicroscopicNormal(v_incomingDirection, q_surfaceNormal.vecPart, material.roughness, randomEngine);
+			sampler->UseSlot(reflectionSlot + i * REFLECTION_SAMPLE_DIMENSIONS);
+
+			Vec3D v_microscopicNormal = MicroscopicNormal(v_incomingDirection, q_surfaceNormal.vecPart, material.roughness, sampler);
 			Vec3D v_outgoingDirection = SubtractVec3D(VecScalarMultiplication3D(v_microscopicNormal, 2 * DotProduct3D(v_incomingDirection, v_microscopicNormal)), v_incomingDirection);
 
-			AddToVec3D(&v_outgoingDirection, VecScalarMultiplication3D(RandomVec_InUnitSphere(randomEngine), material.roughness));
+			sampler->UseSlot(reflectionSlot + i * REFLECTION_SAMPLE_DIMENSIONS + 4);
+
+			AddToVec3D(&v_outgoingDirection, VecScalarMultiplication3D(RandomVec_InUnitSphere(sampler), material.roughness));
 			NormalizeVec3D(&v_outgoingDirection);
 
 			Vec3D v_nextIntersection = ZERO_VEC3D;
@@ -1287,7 +2336,12 @@ private:
 
 			if (intersectionExists)
 			{
-				Vec3D reflectedColor = CalculateLighting_DistributionTracing(v_nextTextureColor, nextMaterial, q_nextNormal, v_outgoingDirection, v_nextIntersection, bounceCount + 1, randomEngine);
+				// The hit of every reflection has its own range after this hit's
+				sampler->StartBounceAt(hitDimension + DistributionHitDimensions(bounceCount) + i * DistributionTreeDimensions(bounceCount + 1));
+
+				Vec3D reflectedColor = CalculateLighting_DistributionTracing(v_nextTextureColor, nextMaterial, q_nextNormal, v_outgoingDirection, v_nextIntersection, bounceCount + 1, nextRayBudget, sampler);
+
+				sampler->StartBounceAt(hitDimension);
 
 				Vec3D brdf = BRDF_COOKTORRANCE(v_incomingDirection, v_outgoingDirection, q_surfaceNormal.vecPart, v_microscopicNormal, REFRACTION_INDEX_AIR, material.refractionIndex, material.roughness, 0, material.specularValue, false);
 
@@ -1295,27 +2349,46 @@ private:
 			}
 		}
 
-		ScaleVec3D(&averageReflectedLight, 1.0 / SAMPLES_PER_BOUNCE);
+		ScaleVec3D(&averageReflectedLight, reflectionWeight / reflectionSamples);
 
 		v_outgoingLightColor = AddVec3D(v_outgoingLightColor, ConusProduct(averageReflectedLight, albedoColor)); // add reflected color * albedo to outgoing light
 		
 		return v_outgoingLightColor;
 	}
 
-	Vec3D RandomVec_InUnitSphere(std::mt19937* randomEngine)
+	// One sample of the light arriving from an emitter: the emitted light times the solid angle it fills as a fraction of the hemisphere,
+	// estimated from a point sampled with SampleEmitterPoint. Spheres are sampled in their cone, so every unblocked sample has the same weight
+	Vec3D EmitterLight_DistributionTracing(PrimitiveReference emitter, Vec3D v_intersection, Sampler* sampler)
 	{
-		Vec3D randPoint;
+		// Triangles from the baked shading data, an asynchronous ImportScene can reallocate g_triangles while the frame is traced
+		const Material& lightMaterial = (emitter.type == SPHERE_PRIMITIVE) ? g_spheres[emitter.index].material : g_triangleShading[emitter.index].material;
 
-		do
+		Vec3D v_lightPoint = SampleEmitterPoint(emitter, v_intersection, sampler);
+
+		Vec3D directionToLight = SubtractVec3D(v_lightPoint, v_intersection);
+		double lightDistance = VecLength3D(directionToLight);
+		ScaleVec3D(&directionToLight, 1 / lightDistance);
+
+		double pdf = EmitterPointPdf(emitter, v_intersection, v_lightPoint);
+
+		// Shortened so the light source itself doesn't count as a blocker
+		if (pdf == 0 || IsOccluded(v_intersection, directionToLight, lightDistance - OFFSET_DISTANCE))
 		{
-			double randX = uniformDistribution(*randomEngine);
-			double randY = uniformDistribution(*randomEngine);
-			double randZ = uniformDistribution(*randomEngine);
+			return ZERO_VEC3D;
+		}
+
+		return VecScalarMultiplication3D(ConusProduct(lightMaterial.emittance, lightMaterial.diffuseTint), 1 / (pdf * TAU)); // doesn't work if the light source has a texture
+	}
 
-			randPoint = { randX, randY, randZ };
-		} while (VecLengthSquared(randPoint) > 1);
+	// Uniform point inside the unit sphere
+	Vec3D RandomVec_InUnitSphere(Sampler* sampler)
+	{
+		// Drawn in order, the evaluation order of function arguments isn't specified
+		double u1 = sampler->NextDouble();
+		double u2 = sampler->NextDouble();
+		double u3 = sampler->NextDouble();
 
-		return randPoint;
+		return UniformBall(u1, u2, u3);
 	}
 };
 
@@ -1336,5 +2409,6 @@ int main()
 }
 
 #include "Controlls.h"
+#include "Benchmarks.h"
 
 // LEET
\ No newline at end of file
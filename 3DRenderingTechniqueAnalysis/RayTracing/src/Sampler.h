@@ -0,0 +1,400 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "MathUtilities.cuh"
+#include "Random.h"
+
+// Samplers hand out the random numbers of one sample, one dimension at a time. The integrators give every decision its own dimension
+// (the slots of a bounce are fixed, see PathSampleSlot and DistributionSampleSlot), so with a low discrepancy sampler the same decision is well distributed over the samples of a pixel.
+//
+// INDEPENDENT_SAMPLER: every number comes from the sample's RandomGenerator
+// STRATIFIED_SAMPLER: every STRATIFIED_SAMPLE_COUNT consecutive samples of a pixel cover all strata of each dimension once, in a random order per dimension
+// SOBOL_SAMPLER: Owen scrambled Sobol points, padded in groups of 4 dimensions with a shuffled sample index per group
+//                (Burley, "Practical Hash-based Owen Scrambling")
+// BLUE_NOISE_SAMPLER: one Sobol sequence for the whole screen, shifted per pixel by a blue noise mask, so the remaining error of
+//                     neighbouring pixels is uncorrelated and looks like fine grain instead of blotches (Georgiev and Fajardo, "Blue-noise Dithered Sampling")
+
+#define SAMPLER_CAMERA_DIMENSIONS 4 // dimensions before the first bounce, for the pixel jitter
+#define SAMPLER_BOUNCE_DIMENSIONS 16 // dimensions reserved for every bounce
+#define STRATIFIED_SAMPLE_COUNT 16
+#define BLUE_NOISE_SIZE 64 // width and height of the tiled blue noise mask
+#define BLUE_NOISE_SIGMA 1.5 // of the gaussian energy used by void and cluster
+
+enum SamplerType
+{
+	INDEPENDENT_SAMPLER,
+	STRATIFIED_SAMPLER,
+	SOBOL_SAMPLER,
+	BLUE_NOISE_SAMPLER,
+	SAMPLER_TYPE_COUNT
+};
+
+const char* SamplerName(SamplerType type)
+{
+	switch (type)
+	{
+	case INDEPENDENT_SAMPLER: return "independent";
+	case STRATIFIED_SAMPLER: return "stratified";
+	case SOBOL_SAMPLER: return "Sobol";
+	case BLUE_NOISE_SAMPLER: return "blue noise dithered Sobol";
+	default: return "unknown";
+	}
+}
+
+// Threshold values in [0, 1) built with Ulichney's void and cluster method. Tiles seamlessly
+struct BlueNoiseMask
+{
+	std::vector<double> values;
+};
+
+void BuildBlueNoiseMask(BlueNoiseMask* mask)
+{
+	const int pixelCount = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+
+	// Gaussian falloff by wrapped offset, so the energy of a pixel can be updated in O(1) per other pixel
+	std::vector<double> falloff(pixelCount);
+
+	for (int y = 0; y < BLUE_NOISE_SIZE; y++)
+	{
+		for (int x = 0; x < BLUE_NOISE_SIZE; x++)
+		{
+			int dx = int(Min(x, BLUE_NOISE_SIZE - x));
+			int dy = int(Min(y, BLUE_NOISE_SIZE - y));
+
+			falloff[y * BLUE_NOISE_SIZE + x] = exp(-(dx * dx + dy * dy) / (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+		}
+	}
+
+	std::vector<bool> isSet(pixelCount, false);
+	std::vector<double> energy(pixelCount, 0);
+
+	auto Toggle = [&](int pixel)
+	{
+		isSet[pixel] = !isSet[pixel];
+
+		double sign = isSet[pixel] ? 1 : -1;
+		int pixelX = pixel % BLUE_NOISE_SIZE;
+		int pixelY = pixel / BLUE_NOISE_SIZE;
+
+		for (int y = 0; y < BLUE_NOISE_SIZE; y++)
+		{
+			for (int x = 0; x < BLUE_NOISE_SIZE; x++)
+			{
+				int offsetX = (x - pixelX + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE;
+				int offsetY = (y - pixelY + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE;
+
+				energy[y * BLUE_NOISE_SIZE + x] += sign * falloff[offsetY * BLUE_NOISE_SIZE + offsetX];
+			}
+		}
+	};
+
+	// The set pixel with the most energy around it, or the unset pixel with the least
+	auto Extreme = [&](bool tightestCluster)
+	{
+		int bestPixel = -1;
+
+		for (int i = 0; i < pixelCount; i++)
+		{
+			if (isSet[i] != tightestCluster) continue;
+
+			if (bestPixel == -1 || (tightestCluster ? energy[i] > energy[bestPixel] : energy[i] < energy[bestPixel]))
+			{
+				bestPixel = i;
+			}
+		}
+
+		return bestPixel;
+	};
+
+	// Random initial pattern, then move the tightest cluster into the largest void until that doesn't change anything
+	RandomGenerator randomGenerator(1337);
+	int initialCount = pixelCount / 10;
+
+	for (int i = 0; i < initialCount; i++)
+	{
+		int pixel;
+
+		do
+		{
+			pixel = int(randomGenerator.NextDouble() * pixelCount);
+		} while (isSet[pixel]);
+
+		Toggle(pixel);
+	}
+
+	for (int i = 0; i < pixelCount; i++) // converges long before this
+	{
+		int cluster = Extreme(true);
+		Toggle(cluster);
+
+		int largestVoid = Extreme(false);
+		Toggle(largestVoid);
+
+		if (largestVoid == cluster) break;
+	}
+
+	std::vector<int> ranks(pixelCount);
+	std::vector<bool> initialPattern = isSet;
+	std::vector<double> initialEnergy = energy;
+
+	// Ranks below the initial count: take the tightest clusters out of the initial pattern
+	for (int rank = initialCount - 1; rank >= 0; rank--)
+	{
+		int cluster = Extreme(true);
+		Toggle(cluster);
+		ranks[cluster] = rank;
+	}
+
+	isSet = initialPattern;
+	energy = initialEnergy;
+
+	// The other ranks: keep filling the largest void
+	for (int rank = initialCount; rank < pixelCount; rank++)
+	{
+		int largestVoid = Extreme(false);
+		Toggle(largestVoid);
+		ranks[largestVoid] = rank;
+	}
+
+	mask->values.resize(pixelCount);
+
+	for (int i = 0; i < pixelCount; i++)
+	{
+		mask->values[i] = (ranks[i] + 0.5) / pixelCount;
+	}
+}
+
+inline uint32_t ReverseBits(uint32_t x)
+{
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00FF00FF) << 8) | ((x & 0xFF00FF00) >> 8);
+	x = ((x & 0x0F0F0F0F) << 4) | ((x & 0xF0F0F0F0) >> 4);
+	x = ((x & 0x33333333) << 2) | ((x & 0xCCCCCCCC) >> 2);
+	x = ((x & 0x55555555) << 1) | ((x & 0xAAAAAAAA) >> 1);
+
+	return x;
+}
+
+// Laine and Karras' hash, every bit only depends on the bits below it
+inline uint32_t LaineKarrasPermutation(uint32_t x, uint32_t seed)
+{
+	x += seed;
+	x ^= x * 0x6C50B47Cu;
+	x ^= x * 0xB82F1E52u;
+	x ^= x * 0xC7AFE638u;
+	x ^= x * 0x8D22F6E6u;
+
+	return x;
+}
+
+// Owen scrambling: every bit is flipped depending on the bits above it
+inline uint32_t NestedUniformScramble(uint32_t x, uint32_t seed)
+{
+	return ReverseBits(LaineKarrasPermutation(ReverseBits(x), seed));
+}
+
+// Generator matrices of the first 4 Sobol dimensions, from the primitive polynomials and initial direction numbers of Joe and Kuo
+struct SobolMatrices
+{
+	uint32_t directions[4][32];
+
+	SobolMatrices()
+	{
+		const int degrees[4] = { 0, 1, 2, 3 };
+		const uint32_t coefficients[4] = { 0, 0, 1, 1 };
+		const uint32_t initialNumbers[4][3] = { { 0, 0, 0 }, { 1, 0, 0 }, { 1, 3, 0 }, { 1, 3, 1 } };
+
+		for (int bit = 0; bit < 32; bit++)
+		{
+			directions[0][bit] = 1u << (31 - bit); // van der Corput
+		}
+
+		for (int dimension = 1; dimension < 4; dimension++)
+		{
+			int s = degrees[dimension];
+			uint32_t* v = directions[dimension];
+
+			for (int i = 0; i < s; i++)
+			{
+				v[i] = initialNumbers[dimension][i] << (31 - i);
+			}
+
+			for (int i = s; i < 32; i++)
+			{
+				v[i] = v[i - s] ^ (v[i - s] >> s);
+
+				for (int k = 1; k < s; k++)
+				{
+					v[i] ^= ((coefficients[dimension] >> (s - 1 - k)) & 1) * v[i - k];
+				}
+			}
+		}
+	}
+};
+
+// All 4 dimensions of one Sobol point
+inline void SobolSample(uint32_t index, uint32_t* point)
+{
+	static const SobolMatrices matrices;
+
+	point[0] = point[1] = point[2] = point[3] = 0;
+
+	// The scrambled indices have random bits, so a branch per bit would be mispredicted half the time
+	for (int bit = 0; index != 0; bit++, index >>= 1)
+	{
+		uint32_t mask = 0u - (index & 1);
+
+		point[0] ^= matrices.directions[0][bit] & mask;
+		point[1] ^= matrices.directions[1][bit] & mask;
+		point[2] ^= matrices.directions[2][bit] & mask;
+		point[3] ^= matrices.directions[3][bit] & mask;
+	}
+}
+
+// Kensler's hashed permutation ("Correlated Multi-Jittered Sampling"): element i of a random permutation of [0, length) picked by seed
+inline uint32_t PermutationElement(uint32_t i, uint32_t length, uint32_t seed)
+{
+	uint32_t w = length - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+
+	do
+	{
+		i ^= seed;
+		i *= 0xE170893D;
+		i ^= seed >> 16;
+		i ^= (i & w) >> 4;
+		i ^= seed >> 8;
+		i *= 0x0929EB3F;
+		i ^= seed >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | seed >> 27;
+		i *= 0x6935FA69;
+		i ^= (i & w) >> 11;
+		i *= 0x74DCB303;
+		i ^= (i & w) >> 2;
+		i *= 0x9E501CC3;
+		i ^= (i & w) >> 2;
+		i *= 0xC860A3DF;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= length);
+
+	return (i + seed) % length;
+}
+
+struct Sampler
+{
+	SamplerType type = INDEPENDENT_SAMPLER;
+	RandomGenerator randomGenerator; // draws all numbers of the independent sampler
+
+	uint64_t pixelSeed = 0;
+	uint32_t sampleIndex = 0;
+	int pixelX = 0, pixelY = 0;
+	const BlueNoiseMask* blueNoiseMask = nullptr;
+
+	int dimension = 0;
+	int bounceDimension = 0; // first dimension of the current bounce
+
+	// Scrambled point of the current group of 4 Sobol dimensions, the groups are mostly read in order so it's only computed once per group
+	int sobolGroup = -1;
+	uint32_t sobolPoint[4];
+
+	// Independent sampler drawing from the given generator
+	explicit Sampler(RandomGenerator _randomGenerator) : randomGenerator(_randomGenerator)
+	{
+	}
+
+	Sampler(SamplerType _type, int _pixelX, int _pixelY, int pixelIndex, int _sampleIndex, int frameIndex, const BlueNoiseMask* _blueNoiseMask)
+		: type(_type), randomGenerator(SampleRandomGenerator(pixelIndex, _sampleIndex, frameIndex)), pixelSeed(MixBits(uint64_t(pixelIndex) + 1)),
+		sampleIndex(uint32_t(_sampleIndex)), pixelX(_pixelX), pixelY(_pixelY), blueNoiseMask(_blueNoiseMask)
+	{
+	}
+
+	void StartBounce(int bounceCount)
+	{
+		StartBounceAt(SAMPLER_CAMERA_DIMENSIONS + bounceCount * SAMPLER_BOUNCE_DIMENSIONS);
+	}
+
+	// For integrators that branch and lay out the dimensions of their hits themselves, the slots are counted from firstDimension
+	void StartBounceAt(int firstDimension)
+	{
+		bounceDimension = firstDimension;
+		dimension = bounceDimension;
+	}
+
+	// Continues from the given dimension of the current bounce
+	void UseSlot(int slot)
+	{
+		dimension = bounceDimension + slot;
+	}
+
+	// Uniform in [0, 1)
+	double NextDouble()
+	{
+		int currentDimension = dimension++;
+
+		switch (type)
+		{
+		case STRATIFIED_SAMPLER:
+		{
+			uint32_t block = sampleIndex / STRATIFIED_SAMPLE_COUNT;
+			uint64_t hash = MixBits(pixelSeed ^ MixBits(uint64_t(currentDimension) ^ MixBits(block)));
+
+			uint32_t stratum = PermutationElement(sampleIndex % STRATIFIED_SAMPLE_COUNT, STRATIFIED_SAMPLE_COUNT, uint32_t(hash));
+			double jitter = uint32_t(MixBits(hash ^ sampleIndex)) * (1.0 / 4294967296.0);
+
+			return (stratum + jitter) / STRATIFIED_SAMPLE_COUNT;
+		}
+		case SOBOL_SAMPLER:
+			return ScrambledSobol(currentDimension, pixelSeed) * (1.0 / 4294967296.0);
+		case BLUE_NOISE_SAMPLER:
+		{
+			// Every dimension reads the mask at a different offset, so the dimensions aren't shifted the same way
+			uint64_t offsetHash = MixBits(uint64_t(currentDimension) + 1);
+			int maskX = (pixelX + int(offsetHash % BLUE_NOISE_SIZE)) % BLUE_NOISE_SIZE;
+			int maskY = (pixelY + int((offsetHash >> 32) % BLUE_NOISE_SIZE)) % BLUE_NOISE_SIZE;
+
+			double shifted = ScrambledSobol(currentDimension, 0) * (1.0 / 4294967296.0) + blueNoiseMask->values[maskY * BLUE_NOISE_SIZE + maskX];
+
+			return (shifted >= 1) ? shifted - 1 : shifted;
+		}
+		default:
+			return randomGenerator.NextDouble();
+		}
+	}
+
+	// Uniform in [-1, 1)
+	double NextSignedDouble()
+	{
+		return NextDouble() * 2 - 1;
+	}
+
+	uint32_t ScrambledSobol(int sobolDimension, uint64_t seed)
+	{
+		int group = sobolDimension / 4;
+
+		if (group != sobolGroup)
+		{
+			sobolGroup = group;
+
+			// Every group shuffles the sample index differently, so the groups aren't correlated with each other
+			uint32_t groupSeed = uint32_t(MixBits(seed ^ MixBits(uint64_t(group))));
+
+			SobolSample(NestedUniformScramble(sampleIndex, groupSeed), sobolPoint);
+
+			for (int i = 0; i < 4; i++)
+			{
+				sobolPoint[i] = NestedUniformScramble(sobolPoint[i], uint32_t(MixBits(uint64_t(groupSeed) ^ uint64_t(i + 1))));
+			}
+		}
+
+		return sobolPoint[sobolDimension % 4];
+	}
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <vector>
+
+#include "MathUtilities.cuh"
+#include "WorldDatatypes.h"
+
+// Data derived from the scene once when it's loaded, so it doesn't have to be recalculated for every ray
+
+enum PrimitiveType
+{
+	SPHERE_PRIMITIVE,
+	TRIANGLE_PRIMITIVE,
+	GROUND_PRIMITIVE
+};
+
+// Result of the intersection routines, everything needed to evaluate the surface afterwards
+struct HitRecord
+{
+	PrimitiveType type;
+	int index; // index into g_spheres or g_triangles, unused for the ground
+	double t; // measured in multiples of the ray direction
+	double u, v; // barycentric coordinates along the triangle edges, unused for spheres and the ground
+};
+
+// Hot data: only what the intersection loops read, stored as a structure of arrays.
+// Indices match g_spheres and g_triangles, which together with TriangleShadingData make up the cold data
+struct SceneGeometry
+{
+	std::vector<Vec3D> sphereCenters;
+	std::vector<double> sphereRadiiSquared;
+
+	std::vector<Vec3D> triangleVertices0;
+	std::vector<Vec3D> triangleEdges1; // vertices[1] - vertices[0]
+	std::vector<Vec3D> triangleEdges2; // vertices[2] - vertices[0]
+};
+
+// Cold data for shading a triangle, only looked up for the closest hit
+struct TriangleShadingData
+{
+	Vec3D normal; // normalized
+
+	// Normalized tangent and bitangent from the texture coordinates, only calculated if the triangle has a normal map
+	Vec3D tangent = ZERO_VEC3D;
+	Vec3D bitangent = ZERO_VEC3D;
+
+	Vec2D textureVertex0;
+	Vec2D textureEdge1; // textureVertices[1] - textureVertices[0]
+	Vec2D textureEdge2; // textureVertices[2] - textureVertices[0]
+
+	olc::Sprite* texture = nullptr;
+	olc::Sprite* normalMap = nullptr;
+
+	Material material;
+};
+
+TriangleShadingData BakeTriangleShading(const Triangle& triangle)
+{
+	TriangleShadingData shading;
+
+	Vec3D v_triangleEdge1 = SubtractVec3D(triangle.vertices[1], triangle.vertices[0]);
+	Vec3D v_triangleEdge2 = SubtractVec3D(triangle.vertices[2], triangle.vertices[0]);
+
+	shading.normal = ReturnNormalizedVec3D(CrossProduct(v_triangleEdge1, v_triangleEdge2));
+
+	shading.textureVertex0 = triangle.textureVertices[0];
+	shading.textureEdge1 = SubtractVec2D(triangle.textureVertices[1], triangle.textureVertices[0]);
+	shading.textureEdge2 = SubtractVec2D(triangle.textureVertices[2], triangle.textureVertices[0]);
+
+	shading.texture = triangle.texture;
+	shading.normalMap = triangle.normalMap;
+	shading.material = triangle.material;
+
+	if (triangle.normalMap != nullptr)
+	{
+		// Solves for the tangent (T) and bitangent (B) of the triangle, see TriangleIntersection_RT for the derivation
+		//
+		// | T.x  B.x  0 |   | edge1.x  edge2.x  0 |   | u2 - u1  u3 - u1  0 | -1
+		// | T.y  B.y  0 | = | edge1.y  edge2.y  0 | * | v2 - v1  v3 - v1  0 |
+		// | T.z  B.z  0 |   | edge1.z  edge2.z  0 |   |    0        0     1 |
+
+		Matrix3D m1 =
+		{
+			v_triangleEdge1,
+			v_triangleEdge2,
+			ZERO_VEC3D
+		};
+
+		Matrix3D m2 =
+		{
+			{ shading.textureEdge1.x, shading.textureEdge1.y, 0 },
+			{ shading.textureEdge2.x, shading.textureEdge2.y, 0 },
+			{ 0, 0, 1 }
+		};
+
+		Matrix3D tangentsMatrix = MatrixMultiplication3D(InverseMatrix3D(m2), m1);
+
+		shading.tangent = ReturnNormalizedVec3D(tangentsMatrix.i_Hat);
+		shading.bitangent = ReturnNormalizedVec3D(tangentsMatrix.j_Hat);
+	}
+
+	return shading;
+}
+
+void BakeScene(SceneGeometry* geometry, std::vector<TriangleShadingData>* triangleShading, const std::vector<Sphere>& spheres, const std::vector<Triangle>& triangles)
+{
+	*geometry = SceneGeometry();
+
+	geometry->sphereCenters.reserve(spheres.size());
+	geometry->sphereRadiiSquared.reserve(spheres.size());
+
+	for (const Sphere& sphere : spheres)
+	{
+		geometry->sphereCenters.push_back(sphere.coords);
+		geometry->sphereRadiiSquared.push_back(sphere.radius * sphere.radius);
+	}
+
+	geometry->triangleVertices0.reserve(triangles.size());
+	geometry->triangleEdges1.reserve(triangles.size());
+	geometry->triangleEdges2.reserve(triangles.size());
+
+	triangleShading->clear();
+	triangleShading->reserve(triangles.size());
+
+	for (const Triangle& triangle : triangles)
+	{
+		geometry->triangleVertices0.push_back(triangle.vertices[0]);
+		geometry->triangleEdges1.push_back(SubtractVec3D(triangle.vertices[1], triangle.vertices[0]));
+		geometry->triangleEdges2.push_back(SubtractVec3D(triangle.vertices[2], triangle.vertices[0]));
+
+		triangleShading->push_back(BakeTriangleShading(triangle));
+	}
+}
+
+// Ray/sphere intersection, t is measured in multiples of v_direction (the distance if v_direction is normalized)
+inline bool IntersectSphere(const SceneGeometry& geometry, int sphereIndex, Vec3D v_start, Vec3D v_direction, double* t)
+{
+	Vec3D v_centerToStart = SubtractVec3D(v_start, geometry.sphereCenters[sphereIndex]);
+
+	double a = DotProduct3D(v_direction, v_direction);
+	double halfB = DotProduct3D(v_centerToStart, v_direction);
+	double c = DotProduct3D(v_centerToStart, v_centerToStart) - geometry.sphereRadiiSquared[sphereIndex];
+
+	double rootContent = halfB * halfB - a * c;
+
+	// There exists no intersections (no real answer)
+	if (rootContent < 0) return false;
+
+	double root = sqrt(rootContent);
+
+	// Choose the closest intersection in front of the ray
+	*t = (-halfB - root) / a;
+
+	if (*t < 0)
+	{
+		*t = (-halfB + root) / a;
+	}
+
+	return *t >= 0;
+}
+
+// Moller-Trumbore ray/triangle intersection. t is measured in multiples of v_direction,
+// u and v are the barycentric coordinates of the intersection along edge1 and edge2
+inline bool IntersectTriangle(const SceneGeometry& geometry, int triangleIndex, Vec3D v_start, Vec3D v_direction, double* t, double* u, double* v)
+{
+	const Vec3D& v_triangleEdge1 = geometry.triangleEdges1[triangleIndex];
+	const Vec3D& v_triangleEdge2 = geometry.triangleEdges2[triangleIndex];
+
+	Vec3D p = CrossProduct(v_direction, v_triangleEdge2);
+	double determinant = DotProduct3D(v_triangleEdge1, p);
+
+	if (determinant == 0) return false; // the ray is parallel to the triangle
+
+	double reciprocalDeterminant = 1 / determinant;
+
+	Vec3D v_vertexToStart = SubtractVec3D(v_start, geometry.triangleVertices0[triangleIndex]);
+
+	*u = DotProduct3D(v_vertexToStart, p) * reciprocalDeterminant;
+	if (*u < 0 || *u > 1) return false;
+
+	Vec3D q = CrossProduct(v_vertexToStart, v_triangleEdge1);
+
+	*v = DotProduct3D(v_direction, q) * reciprocalDeterminant;
+	if (*v < 0 || *u + *v > 1) return false;
+
+	*t = DotProduct3D(v_triangleEdge2, q) * reciprocalDeterminant;
+
+	return *t >= 0;
+}
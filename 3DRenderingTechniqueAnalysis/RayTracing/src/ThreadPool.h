@@ -0,0 +1,189 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+
+// Render threads that live for the whole program. Between frames they are parked on a condition variable,
+// RunFrame wakes all of them, lets each one call the work function once and waits until the last one is done.
+// Another thread can hand them a shared job with RunShared, its chunks are run by parked threads right away
+// and by busy ones whenever their work function calls RunSharedChunk
+
+struct ThreadPool
+{
+	std::vector<std::thread> threads;
+	std::vector<double> busyTimes; // seconds each thread spent in the work function during the last frame
+
+	std::function<void(int threadIndex)> work;
+
+	std::mutex mutex;
+	std::condition_variable frameStarted;
+	std::condition_variable frameFinished;
+
+	int frameIndex = 0;
+	int runningCount = 0;
+	bool stopping = false;
+
+	std::function<void(int chunk)> sharedJob;
+	int sharedChunkCount = 0;
+	int nextSharedChunk = 0;
+	int unfinishedSharedChunkCount = 0;
+	std::condition_variable sharedJobFinished;
+
+	~ThreadPool()
+	{
+		Stop();
+	}
+
+	void Start(int threadCount, std::function<void(int threadIndex)> _work)
+	{
+		work = _work;
+		busyTimes.assign(threadCount, 0);
+
+		for (int i = 0; i < threadCount; i++)
+		{
+			threads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+		}
+	}
+
+	void Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+
+		frameStarted.notify_all();
+
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+
+		threads.clear();
+	}
+
+	void RunFrame()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		frameIndex++;
+		runningCount = int(threads.size());
+
+		frameStarted.notify_all();
+
+		frameFinished.wait(lock, [this]() { return runningCount == 0; });
+	}
+
+	// Lets every thread call job once instead of the work function, for steps between the frames like the denoiser
+	void RunJob(std::function<void(int threadIndex)> job)
+	{
+		std::function<void(int threadIndex)> frameWork = std::move(work);
+
+		work = std::move(job);
+		RunFrame();
+		work = std::move(frameWork);
+	}
+
+	// Splits job into chunkCount chunks for the threads of the pool and runs chunks on the calling thread as well, until every chunk is done.
+	// Only one thread may run shared jobs, a frame can run at the same time
+	void RunShared(std::function<void(int chunk)> job, int chunkCount)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			sharedJob = std::move(job);
+			sharedChunkCount = chunkCount;
+			nextSharedChunk = 0;
+			unfinishedSharedChunkCount = chunkCount;
+		}
+
+		frameStarted.notify_all();
+
+		while (RunSharedChunk())
+		{
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+
+		sharedJobFinished.wait(lock, [this]() { return unfinishedSharedChunkCount == 0; });
+
+		sharedJob = nullptr;
+	}
+
+	// Runs one chunk of the shared job, false if no chunk is left to start
+	bool RunSharedChunk()
+	{
+		int chunk;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if (nextSharedChunk >= sharedChunkCount) return false;
+
+			chunk = nextSharedChunk++;
+		}
+
+		// The job isn't replaced before this chunk is counted as finished
+		sharedJob(chunk);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if (--unfinishedSharedChunkCount == 0)
+			{
+				sharedJobFinished.notify_all();
+			}
+		}
+
+		return true;
+	}
+
+	void WorkerLoop(int threadIndex)
+	{
+		int lastFrameIndex = 0;
+
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+
+				frameStarted.wait(lock, [&]() { return stopping || frameIndex != lastFrameIndex || nextSharedChunk < sharedChunkCount; });
+
+				if (stopping) return;
+
+				if (frameIndex == lastFrameIndex)
+				{
+					lock.unlock();
+
+					while (RunSharedChunk())
+					{
+					}
+
+					continue;
+				}
+
+				lastFrameIndex = frameIndex;
+			}
+
+			auto start = std::chrono::steady_clock::now();
+
+			work(threadIndex);
+
+			std::chrono::duration<double> busyTime = std::chrono::steady_clock::now() - start;
+			busyTimes[threadIndex] = busyTime.count();
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+
+				if (--runningCount == 0)
+				{
+					frameFinished.notify_one();
+				}
+			}
+		}
+	}
+};
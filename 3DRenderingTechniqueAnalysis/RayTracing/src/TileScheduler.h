@@ -0,0 +1,120 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+
+#include "MathUtilities.cuh"
+
+// Splits the screen into small tiles and hands them out to the render threads with work stealing:
+// every thread starts with its own queue of neighbouring tiles, and when it runs out it steals from the others,
+// so threads that got cheap tiles help out with the expensive ones instead of idling at the end of the frame
+
+#define TILE_SIZE 16
+
+struct Tile
+{
+	int startX, startY;
+	int endX, endY; // exclusive
+};
+
+struct TileQueue
+{
+	std::mutex mutex;
+	std::deque<int> tiles;
+};
+
+struct TileScheduler
+{
+	std::vector<Tile> tiles;
+	std::vector<TileQueue> queues;
+	std::atomic<int> stolenTileCount{ 0 };
+	std::atomic<int> remainingTileCount{ 0 }; // tiles not handed out yet, 0 once the pass is done
+
+	TileScheduler(int screenWidth, int screenHeight)
+	{
+		for (int y = 0; y < screenHeight; y += TILE_SIZE)
+		{
+			for (int x = 0; x < screenWidth; x += TILE_SIZE)
+			{
+				tiles.push_back({ x, y, int(Min(x + TILE_SIZE, screenWidth)), int(Min(y + TILE_SIZE, screenHeight)) });
+			}
+		}
+	}
+
+	// Fills the queues for a new pass over the screen. Each thread gets a contiguous run of tiles so it starts with neighbouring pixels
+	void Reset(int threadCount)
+	{
+		if (queues.size() != threadCount)
+		{
+			queues = std::vector<TileQueue>(threadCount);
+		}
+
+		for (int i = 0; i < threadCount; i++)
+		{
+			int firstTile = int(tiles.size() * i / threadCount);
+			int lastTile = int(tiles.size() * (i + 1) / threadCount);
+
+			std::lock_guard<std::mutex> lock(queues[i].mutex);
+
+			queues[i].tiles.clear();
+
+			for (int tile = firstTile; tile < lastTile; tile++)
+			{
+				queues[i].tiles.push_back(tile);
+			}
+		}
+
+		remainingTileCount = int(tiles.size());
+	}
+
+	// Drops the tiles that haven't been handed out yet
+	void Cancel()
+	{
+		for (TileQueue& queue : queues)
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+
+			queue.tiles.clear();
+		}
+
+		remainingTileCount = 0;
+	}
+
+	// Returns false once every tile of the frame has been handed out
+	bool NextTile(int threadIndex, Tile* tile)
+	{
+		// Take from the front of the thread's own queue
+		{
+			TileQueue& ownQueue = queues[threadIndex];
+			std::lock_guard<std::mutex> lock(ownQueue.mutex);
+
+			if (!ownQueue.tiles.empty())
+			{
+				*tile = tiles[ownQueue.tiles.front()];
+				ownQueue.tiles.pop_front();
+				remainingTileCount--;
+				return true;
+			}
+		}
+
+		// Steal from the back of the other queues, furthest away from where their owners are working
+		for (int i = 1; i < queues.size(); i++)
+		{
+			TileQueue& victimQueue = queues[(threadIndex + i) % queues.size()];
+			std::lock_guard<std::mutex> lock(victimQueue.mutex);
+
+			if (!victimQueue.tiles.empty())
+			{
+				*tile = tiles[victimQueue.tiles.back()];
+				victimQueue.tiles.pop_back();
+				stolenTileCount++;
+				remainingTileCount--;
+				return true;
+			}
+		}
+
+		return false;
+	}
+};
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cmath>
+
+#include "MathUtilities.cuh"
+
+#define PRECISE_PI 3.14159265358979323846 // PI is too coarse for the areas of small spherical triangles
+
+// Closed form warps from uniform numbers in [0, 1) to the distributions the tracers sample, each with its pdf.
+// They take a fixed number of uniforms, so every sample costs the same and uses the same sampler dimensions.
+// Local frames follow the tracers' convention: y is the normal, x and z span the tangent plane (see TangentFrame)
+
+// Frame with the normal as j_Hat, for VecMatrixMultiplication3D from local to world (Duff et al., "Building an Orthonormal Basis, Revisited")
+Matrix3D TangentFrame(Vec3D v_normal)
+{
+	double sign = std::copysign(1.0, v_normal.z);
+	double a = -1 / (sign + v_normal.z);
+	double b = v_normal.x * v_normal.y * a;
+
+	return
+	{
+		{ 1 + sign * v_normal.x * v_normal.x * a, sign * b, -sign * v_normal.x },
+		v_normal,
+		{ b, sign + v_normal.y * v_normal.y * a, -v_normal.y }
+	};
+}
+
+// Inverse of VecMatrixMultiplication3D for an orthonormal frame
+Vec3D WorldToLocal(Vec3D v, Matrix3D frame)
+{
+	return { DotProduct3D(v, frame.i_Hat), DotProduct3D(v, frame.j_Hat), DotProduct3D(v, frame.k_Hat) };
+}
+
+// Uniform direction
+Vec3D UniformSphere(double u1, double u2)
+{
+	double y = 1 - 2 * u1;
+	double r = sqrt(Max(1 - y * y, 0));
+	double phi = TAU * u2;
+
+	return { r * cos(phi), y, r * sin(phi) };
+}
+
+double UniformSpherePdf()
+{
+	return 1 / (2 * TAU);
+}
+
+// Uniform point inside the unit ball, the distribution of the old rejection loop in RandomVec_InUnitSphere
+Vec3D UniformBall(double u1, double u2, double u3)
+{
+	return VecScalarMultiplication3D(UniformSphere(u1, u2), cbrt(u3));
+}
+
+double UniformBallPdf()
+{
+	return 3 / (2 * TAU);
+}
+
+// Direction around the y axis with a pdf proportional to its cosine
+Vec3D CosineHemisphere(double u1, double u2)
+{
+	double r = sqrt(u1);
+	double phi = TAU * u2;
+
+	return { r * cos(phi), sqrt(Max(1 - u1, 0)), r * sin(phi) };
+}
+
+double CosineHemispherePdf(double cosTheta)
+{
+	return Max(cosTheta, 0) / PI;
+}
+
+// Uniform direction inside the cone around the y axis. The half angle is passed as 1 - cos, which small cones need for precision
+Vec3D UniformCone(double u1, double u2, double oneMinusCosThetaMax)
+{
+	double cosTheta = 1 - u1 * oneMinusCosThetaMax;
+	double sinTheta = sqrt(Max(1 - cosTheta * cosTheta, 0));
+	double phi = TAU * u2;
+
+	return { sinTheta * cos(phi), cosTheta, sinTheta * sin(phi) };
+}
+
+double UniformConePdf(double oneMinusCosThetaMax)
+{
+	return 1 / (TAU * oneMinusCosThetaMax);
+}
+
+// 1 - cos of the half angle of the cone a sphere fills as seen from a point outside of it at the given squared distance from its center.
+// Computed from the sine, so far away spheres don't lose it to cancellation
+double SphereConeOneMinusCosThetaMax(double distanceSquared, double radius)
+{
+	double sinThetaMax2 = radius * radius / distanceSquared;
+
+	return sinThetaMax2 / (1 + sqrt(Max(1 - sinThetaMax2, 0)));
+}
+
+// Solid angle of the triangle abc seen from the origin (Van Oosterom and Strackee)
+double SphericalTriangleArea(Vec3D a, Vec3D b, Vec3D c)
+{
+	NormalizeVec3D(&a);
+	NormalizeVec3D(&b);
+	NormalizeVec3D(&c);
+
+	return Abs(2 * atan2(DotProduct3D(a, CrossProduct(b, c)), 1 + DotProduct3D(a, b) + DotProduct3D(a, c) + DotProduct3D(b, c)));
+}
+
+// Angle between two unit vectors without the precision loss of acos near 0 and PI
+double AngleBetween(Vec3D v1, Vec3D v2)
+{
+	if (DotProduct3D(v1, v2) < 0)
+	{
+		return PRECISE_PI - 2 * asin(Min(VecLength3D(AddVec3D(v1, v2)) / 2, 1));
+	}
+
+	return 2 * asin(Min(VecLength3D(SubtractVec3D(v2, v1)) / 2, 1));
+}
+
+// Spherical triangles smaller than this lose too much precision, larger ones degenerate to slivers near the horizon. Both are better sampled by area
+#define MIN_SPHERICAL_TRIANGLE_AREA 3e-4
+#define MAX_SPHERICAL_TRIANGLE_AREA 6.22
+
+// Uniform direction inside the solid angle of the triangle abc seen from the origin (Arvo, "Stratified Sampling of Spherical Triangles").
+// Returns false if the triangle is degenerate as seen from the origin. The pdf is 1 / SphericalTriangleArea
+bool SphericalTriangle(Vec3D a, Vec3D b, Vec3D c, double u1, double u2, Vec3D* v_direction)
+{
+	NormalizeVec3D(&a);
+	NormalizeVec3D(&b);
+	NormalizeVec3D(&c);
+
+	Vec3D v_normalAB = CrossProduct(a, b);
+	Vec3D v_normalBC = CrossProduct(b, c);
+	Vec3D v_normalCA = CrossProduct(c, a);
+
+	if (VecLengthSquared(v_normalAB) == 0 || VecLengthSquared(v_normalBC) == 0 || VecLengthSquared(v_normalCA) == 0)
+	{
+		return false;
+	}
+
+	NormalizeVec3D(&v_normalAB);
+	NormalizeVec3D(&v_normalBC);
+	NormalizeVec3D(&v_normalCA);
+
+	// Interior angles at the vertices
+	double alpha = AngleBetween(v_normalAB, VecScalarMultiplication3D(v_normalCA, -1));
+	double beta = AngleBetween(v_normalBC, VecScalarMultiplication3D(v_normalAB, -1));
+	double gamma = AngleBetween(v_normalCA, VecScalarMultiplication3D(v_normalBC, -1));
+
+	// Area of the sub-triangle with the sampled point on the edge bc, plus PI
+	double subAreaPlusPi = Lerp(PRECISE_PI, alpha + beta + gamma, u1);
+
+	double cosAlpha = cos(alpha);
+	double sinAlpha = sin(alpha);
+	double sinPhi = sin(subAreaPlusPi) * cosAlpha - cos(subAreaPlusPi) * sinAlpha;
+	double cosPhi = cos(subAreaPlusPi) * cosAlpha + sin(subAreaPlusPi) * sinAlpha;
+
+	double k1 = cosPhi + cosAlpha;
+	double k2 = sinPhi - sinAlpha * DotProduct3D(a, b);
+
+	double cosEdgeAngle = Clamp((k2 + (k2 * cosPhi - k1 * sinPhi) * cosAlpha) / ((k2 * sinPhi + k1 * cosPhi) * sinAlpha), -1, 1);
+	double sinEdgeAngle = sqrt(Max(1 - cosEdgeAngle * cosEdgeAngle, 0));
+
+	// Third vertex of the sub-triangle, on the arc from a to c
+	Vec3D v_orthogonalC = ReturnNormalizedVec3D(SubtractVec3D(c, VecScalarMultiplication3D(a, DotProduct3D(c, a))));
+	Vec3D v_subTriangleC = AddVec3D(VecScalarMultiplication3D(a, cosEdgeAngle), VecScalarMultiplication3D(v_orthogonalC, sinEdgeAngle));
+
+	// Uniform point on the arc from b to the third vertex
+	double cosTheta = 1 - u2 * (1 - DotProduct3D(v_subTriangleC, b));
+	double sinTheta = sqrt(Max(1 - cosTheta * cosTheta, 0));
+
+	Vec3D v_orthogonalB = ReturnNormalizedVec3D(SubtractVec3D(v_subTriangleC, VecScalarMultiplication3D(b, DotProduct3D(v_subTriangleC, b))));
+
+	*v_direction = AddVec3D(VecScalarMultiplication3D(b, cosTheta), VecScalarMultiplication3D(v_orthogonalB, sinTheta));
+
+	return true;
+}
+
+// GGX normal distribution with the tracers' roughness as alpha
+double GGXDistribution(double cosTheta, double roughness)
+{
+	double alpha2 = roughness * roughness;
+	double denominator = cosTheta * cosTheta * (alpha2 - 1) + 1;
+
+	return (cosTheta > 0) ? alpha2 / (PI * denominator * denominator) : 0;
+}
+
+// Smith masking of the GGX distribution for a direction with the given cosine to the normal
+double GGXMasking(double cosTheta, double roughness)
+{
+	double cos2 = cosTheta * cosTheta;
+	double tan2 = Max(1 - cos2, 0) / cos2;
+
+	return 2 / (1 + sqrt(1 + roughness * roughness * tan2));
+}
+
+// Microfacet normal from the GGX normals visible from v_view, both in the local frame (Heitz, "Sampling the GGX Distribution of Visible Normals").
+// Unlike sampling D(m) * cos, no sample faces away from the viewer, and the weight of a reflection is F * G2 / G1(view) instead of depending on the normal
+Vec3D GGXVisibleNormal(Vec3D v_view, double roughness, double u1, double u2)
+{
+	// Stretch the view so the distribution becomes a hemisphere
+	Vec3D v_stretchedView = ReturnNormalizedVec3D({ roughness * v_view.x, v_view.y, roughness * v_view.z });
+
+	double lengthSquared = v_stretchedView.x * v_stretchedView.x + v_stretchedView.z * v_stretchedView.z;
+
+	Vec3D v_tangent1 = (lengthSquared > 0) ? VecScalarMultiplication3D({ v_stretchedView.z, 0, -v_stretchedView.x }, 1 / sqrt(lengthSquared)) : Vec3D{ 1, 0, 0 };
+	Vec3D v_tangent2 = CrossProduct(v_stretchedView, v_tangent1);
+
+	// Uniform point on the disk, squeezed onto the part of the hemisphere that is visible from the view
+	double r = sqrt(u1);
+	double phi = TAU * u2;
+	double t1 = r * cos(phi);
+	double t2 = r * sin(phi);
+	double s = 0.5 * (1 + v_stretchedView.y);
+
+	t2 = (1 - s) * sqrt(Max(1 - t1 * t1, 0)) + s * t2;
+
+	Vec3D v_stretchedNormal = AddVec3D(AddVec3D(VecScalarMultiplication3D(v_tangent1, t1), VecScalarMultiplication3D(v_tangent2, t2)),
+		VecScalarMultiplication3D(v_stretchedView, sqrt(Max(1 - t1 * t1 - t2 * t2, 0))));
+
+	// Unstretch
+	return ReturnNormalizedVec3D({ roughness * v_stretchedNormal.x, Max(v_stretchedNormal.y, 0), roughness * v_stretchedNormal.z });
+}
+
+// Pdf of GGXVisibleNormal returning v_normal, local frame
+double GGXVisibleNormalPdf(Vec3D v_view, Vec3D v_normal, double roughness)
+{
+	if (v_view.y <= 0) return 0;
+
+	return GGXMasking(v_view.y, roughness) * Max(DotProduct3D(v_view, v_normal), 0) * GGXDistribution(v_normal.y, roughness) / v_view.y;
+}